@@ -9,10 +9,17 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
+    | FUNCTION '(' arg (',' arg)* ')'  # Function
     | CELL  # Cell
+    | REF_ERROR  # RefError
     | NUMBER  # Literal
     ;
 
+arg
+    : CELL ':' CELL  # Range
+    | expr  # Scalar
+    ;
+
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
 fragment INT: [-+]? UINT ;
 fragment UINT: [0-9]+ ;
@@ -27,4 +34,8 @@ SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
 CELL: [A-Z]+[0-9]+ ;
+// a reference shifted off the sheet prints as #REF!
+REF_ERROR: '#REF!' ;
+// SUM, AVERAGE, MIN, MAX, COUNT; the name is checked when building the AST
+FUNCTION: [A-Z]+ ;
 WS: [ \t\n\r]+ -> skip ;
@@ -1,15 +1,23 @@
 #include "FormulaAST.h"
 
+#ifdef SPREADSHEET_USE_ANTLR
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#endif
 #include "cell.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <climits>
 #include <cmath>
+#include <cstddef>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string_view>
 
 namespace ASTImpl {
 
@@ -73,13 +81,25 @@ class Expr
 public:
     virtual ~Expr() = default;
     virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const SheetInterface& sheet) const = 0;
+    // shift is added to every reference, see FormulaAST::PrintFormula()
+    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                                Position shift) const = 0;
+    // Appends the postfix code of the subtree to the program. The code is
+    // optimized on the way: a subtree without references is folded, emits
+    // nothing and returns its value instead, see CompileValue(). Only the
+    // program is optimized, printing still walks the tree as it was parsed.
+    virtual std::optional<double> Compile(Program& program) const = 0;
+
+    // the cells the node stands for when it is an argument of an aggregate
+    // function: ranges and single cells; other nodes are plain values
+    virtual std::optional<Range> AsRange() const {
+        return std::nullopt;
+    }
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, Position shift,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
         auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -88,7 +108,7 @@ public:
             out << '(';
         }
 
-        DoPrintFormula(out, precedence);
+        DoPrintFormula(out, precedence, shift);
 
         if (parens_needed) {
             out << ')';
@@ -97,6 +117,105 @@ public:
 };
 
 namespace {
+// Reads a referenced cell as a number: empty text is zero, numeric text
+// is converted, anything else is an error.
+FormulaInterface::Value ReadCellAsNumber(const SheetInterface& sheet, Position pos)
+{
+    // the numeric value of a text is found once, when the cell is written
+    return sheet.GetNumericValue(pos);
+}
+
+Position ShiftPosition(Position pos, Position shift)
+{
+    return {pos.row + shift.row, pos.col + shift.col};
+}
+
+Range ShiftRange(Range range, Position shift)
+{
+    return {ShiftPosition(range.first, shift), ShiftPosition(range.last, shift)};
+}
+
+Instruction MakeInstruction(OpCode code)
+{
+    Instruction instruction{};
+    instruction.code = code;
+    return instruction;
+}
+
+Instruction MakePushNumber(double number)
+{
+    Instruction instruction = MakeInstruction(OpCode::PushNumber);
+    instruction.operand.number = number;
+    return instruction;
+}
+
+// Compiles expr so that its value ends up on the stack, folded or not
+void CompileValue(const Expr& expr, Program& program)
+{
+    if (auto constant = expr.Compile(program)) {
+        program.push_back(MakePushNumber(*constant));
+    }
+}
+
+struct AggregateFunctionName {
+    AggregateFunction function;
+    std::string_view name;
+};
+
+constexpr AggregateFunctionName AGGREGATE_FUNCTIONS[] = {
+    {AggregateFunction::Sum, "SUM"},
+    {AggregateFunction::Average, "AVERAGE"},
+    {AggregateFunction::Min, "MIN"},
+    {AggregateFunction::Max, "MAX"},
+    {AggregateFunction::Count, "COUNT"},
+};
+
+std::optional<AggregateFunction> FindAggregateFunction(std::string_view name) {
+    for (const auto& entry : AGGREGATE_FUNCTIONS) {
+        if (entry.name == name) {
+            return entry.function;
+        }
+    }
+    return std::nullopt;
+}
+
+std::string_view GetAggregateFunctionName(AggregateFunction function) {
+    for (const auto& entry : AGGREGATE_FUNCTIONS) {
+        if (entry.function == function) {
+            return entry.name;
+        }
+    }
+    assert(false);
+    return {};
+}
+}  // namespace
+
+// Turns the accumulated numbers into the result of the function. Like in
+// spreadsheets, MIN and MAX of no numbers are zero and AVERAGE of no
+// numbers is a division by zero.
+FormulaInterface::Value FinishAggregate(AggregateFunction function, const RangeAccumulator& acc)
+{
+    switch (function) {
+        case AggregateFunction::Sum:
+            return acc.sum;
+        case AggregateFunction::Average:
+            if (acc.count == 0) {
+                return FormulaError::Category::Arithmetic;
+            }
+            return acc.sum / static_cast<double>(acc.count);
+        case AggregateFunction::Min:
+            return acc.count == 0 ? 0.0 : acc.min;
+        case AggregateFunction::Max:
+            return acc.count == 0 ? 0.0 : acc.max;
+        case AggregateFunction::Count:
+            return static_cast<double>(acc.count);
+    }
+    assert(false);
+    return FormulaError::Category::Value;
+}
+
+namespace {
+
 class BinaryOpExpr final : public Expr {
 public:
     enum Type : char {
@@ -107,7 +226,7 @@ public:
     };
 
 public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+    explicit BinaryOpExpr(Type type, ExprPtr lhs, ExprPtr rhs)
         : type_(type)
         , lhs_(std::move(lhs))
         , rhs_(std::move(rhs)) {
@@ -121,10 +240,11 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                        Position shift) const override {
+        lhs_->PrintFormula(out, precedence, shift);
         out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+        rhs_->PrintFormula(out, precedence, shift, /* right_child = */ true);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -144,35 +264,77 @@ public:
         }
     }
 
-    double Evaluate(const SheetInterface& sheet) const override 
-    {
-        switch(type_)
-        {
-            case '+':
-                return lhs_->Evaluate(sheet) + rhs_->Evaluate(sheet);
-                
-            case '-':
-                return lhs_->Evaluate(sheet) - rhs_->Evaluate(sheet);
-                
-            case '*':
-                return lhs_->Evaluate(sheet) * rhs_->Evaluate(sheet);
-                
-            case '/':
-                double result = lhs_->Evaluate(sheet) / rhs_->Evaluate(sheet);
-                if(!std::isfinite(result))
-                {
-                    throw FormulaError::Category::Arithmetic;
-                }
+    // Folds constant operands and drops the operations that leave any double
+    // unchanged: x*1, 1*x, x/1 and x-0. x+0 is kept, as it turns -0 into 0.
+    // Results that are not finite are left to the program, so that the
+    // error is still reported when the formula is evaluated.
+    std::optional<double> Compile(Program& program) const override {
+        std::optional<double> lhs = lhs_->Compile(program);
+        // pushed in advance, so that the code of rhs follows it
+        if (lhs) {
+            program.push_back(MakePushNumber(*lhs));
+        }
+        size_t rhs_begin = program.size();
+        std::optional<double> rhs = rhs_->Compile(program);
+
+        if (lhs && rhs) {
+            double result = Apply(*lhs, *rhs);
+            if (std::isfinite(result)) {
+                program.pop_back();
                 return result;
+            }
+        }
+
+        if (rhs && ((*rhs == 1 && (type_ == Multiply || type_ == Divide))
+                    || (*rhs == 0 && type_ == Subtract && !std::signbit(*rhs)))) {
+            return std::nullopt;
+        }
+
+        if (lhs && *lhs == 1 && type_ == Multiply) {
+            program.erase(program.begin() + rhs_begin - 1);
+            return std::nullopt;
         }
-        
-        throw FormulaException("Error! (BinaryOpExpr::Evaluate())");
+
+        if (rhs) {
+            program.push_back(MakePushNumber(*rhs));
+        }
+
+        switch (type_) {
+            case Add:
+                program.push_back(MakeInstruction(OpCode::Add));
+                break;
+            case Subtract:
+                program.push_back(MakeInstruction(OpCode::Subtract));
+                break;
+            case Multiply:
+                program.push_back(MakeInstruction(OpCode::Multiply));
+                break;
+            case Divide:
+                program.push_back(MakeInstruction(OpCode::Divide));
+                break;
+        }
+        return std::nullopt;
     }
 
 private:
+    double Apply(double lhs, double rhs) const {
+        switch (type_) {
+            case Add:
+                return lhs + rhs;
+            case Subtract:
+                return lhs - rhs;
+            case Multiply:
+                return lhs * rhs;
+            case Divide:
+                return lhs / rhs;
+        }
+        assert(false);
+        return 0;
+    }
+
     Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    ExprPtr lhs_;
+    ExprPtr rhs_;
 };
 
 class UnaryOpExpr final : public Expr 
@@ -184,7 +346,7 @@ public:
     };
 
 public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+    explicit UnaryOpExpr(Type type, ExprPtr operand)
         : type_(type)
         , operand_(std::move(operand)) {
     }
@@ -195,32 +357,38 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                        Position shift) const override {
         out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+        operand_->PrintFormula(out, precedence, shift);
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_UNARY;
     }
 
-    double Evaluate(const SheetInterface& sheet) const override 
-    {
-        switch(type_)
-        {
-            case '+':
-                return operand_->Evaluate(sheet);
-                
-            case '-':
-                return -operand_->Evaluate(sheet);
+    // Unary plus emits nothing, a negation of a negation cancels out.
+    std::optional<double> Compile(Program& program) const override {
+        std::optional<double> operand = operand_->Compile(program);
+
+        if (type_ == UnaryPlus) {
+            return operand;
         }
-        
-        throw FormulaException("Error! (UnaryOpExpr::Evaluate())");
+        if (operand) {
+            return -*operand;
+        }
+        // only a negation ends its code with Negate
+        if (!program.empty() && program.back().code == OpCode::Negate) {
+            program.pop_back();
+        } else {
+            program.push_back(MakeInstruction(OpCode::Negate));
+        }
+        return std::nullopt;
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> operand_;
+    ExprPtr operand_;
 };
 
 class CellExpr final : public Expr 
@@ -231,73 +399,79 @@ public:
     }
 
     void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) 
+        PrintCell(out, *cell_);
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position shift) const override {
+        PrintCell(out, ShiftPosition(*cell_, shift));
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    std::optional<double> Compile(Program& program) const override {
+        Instruction instruction = MakeInstruction(OpCode::LoadCell);
+        instruction.operand.cell = {cell_->row, cell_->col};
+        program.push_back(instruction);
+        return std::nullopt;
+    }
+
+    // as an argument of an aggregate a single cell is a one-cell range, so
+    // its text is skipped instead of being a #VALUE! error
+    std::optional<Range> AsRange() const override {
+        return Range{*cell_, *cell_};
+    }
+
+private:
+    static void PrintCell(std::ostream& out, Position cell) {
+        if (!cell.IsValid()) 
         {
             out << FormulaError::Category::Ref;
         } else 
         {
-            out << cell_->ToString();
+            out << cell.ToString();
         }
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    const Position* cell_ = nullptr;
+};
+
+// A #REF! operand: what a reference shifted off the sheet prints as, so
+// that the printed formula can be parsed back. It evaluates to #REF! like
+// the reference it stands for, and is not a reference itself.
+class RefErrorExpr final : public Expr {
+public:
+    void Print(std::ostream& out) const override {
+        out << FormulaError::Category::Ref;
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position /* shift */) const override {
+        out << FormulaError::Category::Ref;
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
 
-    double Evaluate(const SheetInterface& sheet) const override 
-    {
-        if(cell_ == nullptr)
-        {
-            throw FormulaException("#REF!");
-        }
-         
-        std::variant<std::string, double, FormulaError> val = sheet.GetCachedValue(*cell_);       
-        if(std::holds_alternative<double>(val))
-        {
-            return std::get<double>(val);
-        }
-        
-        if(std::holds_alternative<std::string>(val))
-        {
-            std::string s(std::get<std::string>(val));
-                
-            for (char c : s)
-            {
-                if (!std::isdigit(c) && c != '.' && c != '-') 
-                {
-                    throw FormulaException("#VALUE!");
-                }
-            }
-                
-            try
-            {
-                return s.empty() ? 0 : stod(s);
-            }
-            catch(const std::out_of_range& e)
-            {
-                throw FormulaException("#VALUE!");
-            }
-            catch(const std::invalid_argument& e)
-            {
-                throw FormulaException("#VALUE!");
-            }
-            
-        }
-        
-        if(std::holds_alternative<FormulaError>(val))
-        {
-            throw FormulaException(std::get<FormulaError>(val).ToString());
-        }
-        
-        throw FormulaException("Error! (CellExpr::Evaluate())");
+    // loads a cell so far off the sheet that no shift brings it back, and
+    // the program reports #REF! the same way as for a shifted reference
+    std::optional<double> Compile(Program& program) const override {
+        Instruction instruction = MakeInstruction(OpCode::LoadCell);
+        instruction.operand.cell = OFF_SHEET;
+        program.push_back(instruction);
+        return std::nullopt;
+    }
+
+    std::optional<Range> AsRange() const override {
+        Position cell{OFF_SHEET.row, OFF_SHEET.col};
+        return Range{cell, cell};
     }
 
 private:
-    const Position* cell_ = nullptr;
+    static constexpr CellRef OFF_SHEET{-2 * Position::MAX_ROWS, -2 * Position::MAX_COLS};
 };
 
 class NumberExpr final : public Expr 
@@ -311,7 +485,8 @@ public:
         out << value_;
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position /* shift */) const override {
         out << value_;
     }
 
@@ -319,8 +494,7 @@ public:
         return EP_ATOM;
     }
 
-    double Evaluate([[maybe_unused]]const SheetInterface& sheet) const override 
-    {
+    std::optional<double> Compile(Program& /* program */) const override {
         return value_;
     }
 
@@ -328,9 +502,453 @@ private:
     double value_;
 };
 
+// A rectangular range; it only appears as an argument of an aggregate.
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(const Range* range)
+        : range_(range) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << range_->ToString();
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position shift) const override {
+        Range range = ShiftRange(*range_, shift);
+        if (!range.IsValid()) {
+            out << FormulaError::Category::Ref;
+        } else {
+            out << range.ToString();
+        }
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    std::optional<double> Compile(Program& program) const override {
+        Instruction instruction = MakeInstruction(OpCode::AccumulateRange);
+        instruction.operand.range = {{range_->first.row, range_->first.col},
+                                     {range_->last.row, range_->last.col}};
+        program.push_back(instruction);
+        return std::nullopt;
+    }
+
+    std::optional<Range> AsRange() const override {
+        return *range_;
+    }
+
+private:
+    const Range* range_ = nullptr;
+};
+
+// SUM, AVERAGE, MIN, MAX or COUNT over a list of ranges and values.
+class AggregateExpr final : public Expr {
+public:
+    AggregateExpr(AggregateFunction function, std::pmr::vector<ExprPtr> args)
+        : function_(function)
+        , args_(std::move(args)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << GetAggregateFunctionName(function_);
+        for (const ExprPtr& arg : args_) {
+            out << ' ';
+            arg->Print(out);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position shift) const override {
+        out << GetAggregateFunctionName(function_) << '(';
+        bool first = true;
+        for (const ExprPtr& arg : args_) {
+            if (!first) {
+                out << ',';
+            }
+            first = false;
+            arg->PrintFormula(out, EP_ATOM, shift);
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    // An aggregate of constants only is folded like any other constant.
+    std::optional<double> Compile(Program& program) const override {
+        size_t begin = program.size();
+        program.push_back(MakeInstruction(OpCode::BeginAggregate));
+
+        RangeAccumulator constants;
+        bool all_constant = true;
+
+        for (const ExprPtr& arg : args_) {
+            if (auto range = arg->AsRange()) {
+                Instruction instruction = MakeInstruction(OpCode::AccumulateRange);
+                instruction.operand.range = {{range->first.row, range->first.col},
+                                             {range->last.row, range->last.col}};
+                program.push_back(instruction);
+                all_constant = false;
+            } else if (auto constant = arg->Compile(program)) {
+                program.push_back(MakePushNumber(*constant));
+                program.push_back(MakeInstruction(OpCode::AccumulateValue));
+                constants.Add(*constant);
+            } else {
+                program.push_back(MakeInstruction(OpCode::AccumulateValue));
+                all_constant = false;
+            }
+        }
+
+        if (all_constant) {
+            FormulaInterface::Value value = FinishAggregate(function_, constants);
+            if (std::holds_alternative<double>(value) && std::isfinite(std::get<double>(value))) {
+                program.resize(begin);
+                return std::get<double>(value);
+            }
+        }
+
+        Instruction instruction = MakeInstruction(OpCode::EndAggregate);
+        instruction.operand.function = function_;
+        program.push_back(instruction);
+        return std::nullopt;
+    }
+
+private:
+    AggregateFunction function_;
+    std::pmr::vector<ExprPtr> args_;
+};
+
+// Hand-written recursive descent parser for the grammar in Formula.g4.
+// Tokens are views into the source text and only one token of lookahead is
+// kept, so the only allocations are the AST nodes themselves.
+class RecursiveDescentParser {
+public:
+    RecursiveDescentParser(std::string_view text, std::pmr::memory_resource* arena)
+        : text_(text)
+        , arena_(arena) {
+        Advance();
+    }
+
+    ExprPtr ParseMain() {
+        auto root = ParseExpr();
+        if (token_.type != TokenType::End) {
+            throw ParsingError("Error when parsing: " + std::string(token_.text));
+        }
+        return root;
+    }
+
+    CellList MoveCells() {
+        return std::move(cells_);
+    }
+
+    RangeList MoveRanges() {
+        return std::move(ranges_);
+    }
+
+private:
+    enum class TokenType {
+        Number,
+        Cell,
+        Function,
+        RefError,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        LeftParen,
+        RightParen,
+        Colon,
+        Comma,
+        End,
+    };
+
+    struct Token {
+        TokenType type = TokenType::End;
+        std::string_view text;
+    };
+
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool IsUpper(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    size_t SkipDigits(size_t pos) const {
+        while (pos < text_.size() && IsDigit(text_[pos])) {
+            ++pos;
+        }
+        return pos;
+    }
+
+    // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+    size_t LexNumber(size_t pos) const {
+        size_t end = SkipDigits(pos);
+        if (end < text_.size() && text_[end] == '.' && end + 1 < text_.size()
+            && IsDigit(text_[end + 1])) {
+            end = SkipDigits(end + 1);
+        }
+        if (end == pos) {
+            return pos;
+        }
+
+        // the exponent is only taken when it is complete, like the longest
+        // match of the ANTLR lexer would do
+        if (end < text_.size() && (text_[end] == 'e' || text_[end] == 'E')) {
+            size_t exponent = end + 1;
+            if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+                ++exponent;
+            }
+            if (exponent < text_.size() && IsDigit(text_[exponent])) {
+                end = SkipDigits(exponent);
+            }
+        }
+        return end;
+    }
+
+    void Advance() {
+        while (pos_ < text_.size()
+               && (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n'
+                   || text_[pos_] == '\r')) {
+            ++pos_;
+        }
+
+        if (pos_ == text_.size()) {
+            token_ = {TokenType::End, {}};
+            return;
+        }
+
+        size_t begin = pos_;
+        char c = text_[pos_];
+        TokenType type;
+
+        switch (c) {
+            case '+':
+                type = TokenType::Add;
+                ++pos_;
+                break;
+            case '-':
+                type = TokenType::Sub;
+                ++pos_;
+                break;
+            case '*':
+                type = TokenType::Mul;
+                ++pos_;
+                break;
+            case '/':
+                type = TokenType::Div;
+                ++pos_;
+                break;
+            case '(':
+                type = TokenType::LeftParen;
+                ++pos_;
+                break;
+            case ')':
+                type = TokenType::RightParen;
+                ++pos_;
+                break;
+            case ':':
+                type = TokenType::Colon;
+                ++pos_;
+                break;
+            case ',':
+                type = TokenType::Comma;
+                ++pos_;
+                break;
+            case '#':
+                // REF_ERROR: '#REF!'
+                if (text_.substr(pos_, REF_ERROR.size()) != REF_ERROR) {
+                    throw ParsingError("Error when lexing: " + std::string(1, c));
+                }
+                type = TokenType::RefError;
+                pos_ += REF_ERROR.size();
+                break;
+            default:
+                if (IsUpper(c)) {
+                    // CELL: [A-Z]+[0-9]+, FUNCTION: [A-Z]+
+                    size_t digits = pos_;
+                    while (digits < text_.size() && IsUpper(text_[digits])) {
+                        ++digits;
+                    }
+                    pos_ = SkipDigits(digits);
+                    type = pos_ == digits ? TokenType::Function : TokenType::Cell;
+                } else {
+                    pos_ = LexNumber(pos_);
+                    if (pos_ == begin) {
+                        throw ParsingError("Error when lexing: " + std::string(1, c));
+                    }
+                    type = TokenType::Number;
+                }
+                break;
+        }
+
+        token_ = {type, text_.substr(begin, pos_ - begin)};
+    }
+
+    // expr: term ((ADD | SUB) term)*
+    ExprPtr ParseExpr() {
+        auto lhs = ParseTerm();
+        while (token_.type == TokenType::Add || token_.type == TokenType::Sub) {
+            auto type = token_.type == TokenType::Add ? BinaryOpExpr::Add : BinaryOpExpr::Subtract;
+            Advance();
+            lhs = MakePooled<BinaryOpExpr>(arena_, type, std::move(lhs), ParseTerm());
+        }
+        return lhs;
+    }
+
+    // term: unary ((MUL | DIV) unary)*
+    ExprPtr ParseTerm() {
+        auto lhs = ParseUnary();
+        while (token_.type == TokenType::Mul || token_.type == TokenType::Div) {
+            auto type = token_.type == TokenType::Mul ? BinaryOpExpr::Multiply : BinaryOpExpr::Divide;
+            Advance();
+            lhs = MakePooled<BinaryOpExpr>(arena_, type, std::move(lhs), ParseUnary());
+        }
+        return lhs;
+    }
+
+    // unary: (ADD | SUB) unary | atom
+    ExprPtr ParseUnary() {
+        if (token_.type == TokenType::Add || token_.type == TokenType::Sub) {
+            auto type = token_.type == TokenType::Add ? UnaryOpExpr::UnaryPlus : UnaryOpExpr::UnaryMinus;
+            Advance();
+            return MakePooled<UnaryOpExpr>(arena_, type, ParseUnary());
+        }
+        return ParseAtom();
+    }
+
+    // the token after the current one, without consuming anything
+    Token PeekNext() {
+        size_t saved_pos = pos_;
+        Token saved_token = token_;
+        Advance();
+        Token next = token_;
+        pos_ = saved_pos;
+        token_ = saved_token;
+        return next;
+    }
+
+    Position ParseCellPosition(std::string_view text) const {
+        auto value = Position::FromString(text);
+        if (!value.IsValid()) {
+            throw FormulaException("Invalid position: " + std::string(text));
+        }
+        return value;
+    }
+
+    // arg: CELL ':' CELL | expr
+    ExprPtr ParseArgument() {
+        if (token_.type != TokenType::Cell || PeekNext().type != TokenType::Colon) {
+            return ParseExpr();
+        }
+
+        Position first = ParseCellPosition(token_.text);
+        Advance();
+        Advance();
+        if (token_.type != TokenType::Cell) {
+            throw ParsingError("Error when parsing: expected a cell after ':'");
+        }
+        Position last = ParseCellPosition(token_.text);
+        Advance();
+
+        ranges_.push_front(Range::FromCorners(first, last));
+        return MakePooled<RangeExpr>(arena_, &ranges_.front());
+    }
+
+    // FUNCTION '(' arg (',' arg)* ')'
+    ExprPtr ParseFunction() {
+        auto function = FindAggregateFunction(token_.text);
+        if (!function) {
+            throw ParsingError("Unknown function: " + std::string(token_.text));
+        }
+        Advance();
+
+        if (token_.type != TokenType::LeftParen) {
+            throw ParsingError("Error when parsing: expected '(' after a function name");
+        }
+        Advance();
+
+        std::pmr::vector<ExprPtr> args(arena_);
+        args.push_back(ParseArgument());
+        while (token_.type == TokenType::Comma) {
+            Advance();
+            args.push_back(ParseArgument());
+        }
+
+        if (token_.type != TokenType::RightParen) {
+            throw ParsingError("Error when parsing: expected ')'");
+        }
+        Advance();
+
+        return MakePooled<AggregateExpr>(arena_, *function, std::move(args));
+    }
+
+    // atom: '(' expr ')' | function | CELL | REF_ERROR | NUMBER
+    ExprPtr ParseAtom() {
+        Token token = token_;
+
+        switch (token.type) {
+            case TokenType::LeftParen: {
+                Advance();
+                auto expr = ParseExpr();
+                if (token_.type != TokenType::RightParen) {
+                    throw ParsingError("Error when parsing: expected ')'");
+                }
+                Advance();
+                return expr;
+            }
+            case TokenType::Function:
+                return ParseFunction();
+            case TokenType::Cell: {
+                auto value = ParseCellPosition(token.text);
+                Advance();
+
+                cells_.push_front(value);
+                return MakePooled<CellExpr>(arena_, &cells_.front());
+            }
+            case TokenType::RefError:
+                Advance();
+                return MakePooled<RefErrorExpr>(arena_);
+            case TokenType::Number: {
+                double value = 0;
+                auto [end, error] = std::from_chars(token.text.data(),
+                                                    token.text.data() + token.text.size(), value);
+                if (error != std::errc() || end != token.text.data() + token.text.size()) {
+                    throw ParsingError("Invalid number: " + std::string(token.text));
+                }
+                Advance();
+                return MakePooled<NumberExpr>(arena_, value);
+            }
+            case TokenType::End:
+                throw ParsingError("Error when parsing: unexpected end of formula");
+            default:
+                throw ParsingError("Error when parsing: " + std::string(token.text));
+        }
+    }
+
+    static constexpr std::string_view REF_ERROR = "#REF!";
+
+    std::string_view text_;
+    size_t pos_ = 0;
+    Token token_;
+    std::pmr::memory_resource* arena_;
+    CellList cells_{arena_};
+    RangeList ranges_{arena_};
+};
+
+#ifdef SPREADSHEET_USE_ANTLR
 class ParseASTListener final : public FormulaBaseListener {
 public:
-    std::unique_ptr<Expr> MoveRoot() {
+    explicit ParseASTListener(std::pmr::memory_resource* arena)
+        : arena_(arena) {
+    }
+
+    ExprPtr MoveRoot() {
         assert(args_.size() == 1);
         auto root = std::move(args_.front());
         args_.clear();
@@ -338,10 +956,14 @@ public:
         return root;
     }
 
-    std::forward_list<Position> MoveCells() {
+    CellList MoveCells() {
         return std::move(cells_);
     }
 
+    RangeList MoveRanges() {
+        return std::move(ranges_);
+    }
+
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
@@ -356,7 +978,7 @@ public:
             type = UnaryOpExpr::UnaryPlus;
         }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
+        auto node = MakePooled<UnaryOpExpr>(arena_, type, std::move(operand));
         args_.back() = std::move(node);
     }
 
@@ -369,7 +991,7 @@ public:
             throw ParsingError("Invalid number: " + valueStr);
         }
 
-        auto node = std::make_unique<NumberExpr>(value);
+        auto node = MakePooled<NumberExpr>(arena_, value);
         args_.push_back(std::move(node));
     }
 
@@ -381,10 +1003,14 @@ public:
         }
 
         cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
+        auto node = MakePooled<CellExpr>(arena_, &cells_.front());
         args_.push_back(std::move(node));
     }
 
+    void exitRefError(FormulaParser::RefErrorContext* /* ctx */) override {
+        args_.push_back(MakePooled<RefErrorExpr>(arena_));
+    }
+
     void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
         assert(args_.size() >= 2);
 
@@ -405,17 +1031,53 @@ public:
             type = BinaryOpExpr::Divide;
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+        auto node = MakePooled<BinaryOpExpr>(arena_, type, std::move(lhs), std::move(rhs));
         args_.back() = std::move(node);
     }
 
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        Position corners[2];
+        for (size_t i = 0; i < 2; ++i) {
+            auto value_str = ctx->CELL(i)->getSymbol()->getText();
+            corners[i] = Position::FromString(value_str);
+            if (!corners[i].IsValid()) {
+                throw FormulaException("Invalid position: " + value_str);
+            }
+        }
+
+        ranges_.push_front(Range::FromCorners(corners[0], corners[1]));
+        auto node = MakePooled<RangeExpr>(arena_, &ranges_.front());
+        args_.push_back(std::move(node));
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        auto name = ctx->FUNCTION()->getSymbol()->getText();
+        auto function = FindAggregateFunction(name);
+        if (!function) {
+            throw ParsingError("Unknown function: " + name);
+        }
+
+        size_t count = ctx->arg().size();
+        assert(args_.size() >= count);
+
+        std::pmr::vector<ExprPtr> args(arena_);
+        args.reserve(count);
+        std::move(args_.end() - count, args_.end(), std::back_inserter(args));
+        args_.resize(args_.size() - count);
+
+        auto node = MakePooled<AggregateExpr>(arena_, *function, std::move(args));
+        args_.push_back(std::move(node));
+    }
+
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
         throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    std::pmr::memory_resource* arena_;
+    std::vector<ExprPtr> args_;
+    CellList cells_{arena_};
+    RangeList ranges_{arena_};
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -427,10 +1089,18 @@ public:
         throw ParsingError("Error when lexing: " + msg);
     }
 };
+#endif
 
 }  // namespace
+
+// a typical formula fits into the first block of its arena
+std::unique_ptr<std::pmr::monotonic_buffer_resource> MakeArena() {
+    constexpr size_t INITIAL_ARENA_SIZE = 512;
+    return std::make_unique<std::pmr::monotonic_buffer_resource>(INITIAL_ARENA_SIZE);
+}
 }  // namespace ASTImpl
 
+#ifdef SPREADSHEET_USE_ANTLR
 FormulaAST ParseFormulaAST(std::istream& in) 
 {
     using namespace antlr4;
@@ -450,16 +1120,32 @@ FormulaAST ParseFormulaAST(std::istream& in)
     parser.removeErrorListeners();
 
     tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
+    auto arena = ASTImpl::MakeArena();
+    ASTImpl::ParseASTListener listener(arena.get());
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    auto root = listener.MoveRoot();
+    return FormulaAST(std::move(arena), std::move(root), listener.MoveCells(),
+                      listener.MoveRanges());
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
     std::istringstream in(in_str);
     return ParseFormulaAST(in);
 }
+#else
+FormulaAST ParseFormulaAST(std::istream& in) {
+    std::string in_str{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    return ParseFormulaAST(in_str);
+}
+
+FormulaAST ParseFormulaAST(const std::string& in_str) {
+    auto arena = ASTImpl::MakeArena();
+    ASTImpl::RecursiveDescentParser parser(in_str, arena.get());
+    auto root = parser.ParseMain();
+    return FormulaAST(std::move(arena), std::move(root), parser.MoveCells(), parser.MoveRanges());
+}
+#endif
 
 void FormulaAST::PrintCells(std::ostream& out) const {
     for (auto cell : cells_) {
@@ -471,32 +1157,266 @@ void FormulaAST::Print(std::ostream& out) const {
     root_expr_->Print(out);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::ostream& out, Position shift) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM, shift);
 }
 
-double FormulaAST::Execute(const SheetInterface& sheet) const 
+FormulaInterface::Value FormulaAST::Execute(const SheetInterface& sheet, Position shift) const
 {
-    try
-    {
-        return root_expr_->Evaluate(sheet);
+    using ASTImpl::OpCode;
+
+    // typical formulas fit into the inline stack, deep ones get a heap one
+    constexpr size_t INLINE_STACK_DEPTH = 32;
+    double inline_stack[INLINE_STACK_DEPTH];
+    std::vector<double> heap_stack;
+    double* stack = inline_stack;
+
+    if (max_stack_depth_ > INLINE_STACK_DEPTH) {
+        heap_stack.resize(max_stack_depth_);
+        stack = heap_stack.data();
     }
-    catch(FormulaException& e)
-    {
-        throw e;
+
+    size_t top = 0;
+
+    constexpr size_t INLINE_AGGREGATE_DEPTH = 4;
+    RangeAccumulator inline_accumulators[INLINE_AGGREGATE_DEPTH];
+    std::vector<RangeAccumulator> heap_accumulators;
+    RangeAccumulator* accumulators = inline_accumulators;
+
+    if (max_aggregate_depth_ > INLINE_AGGREGATE_DEPTH) {
+        heap_accumulators.resize(max_aggregate_depth_);
+        accumulators = heap_accumulators.data();
     }
-    catch(...)
-    {
-        throw FormulaException("#ARITHM!");
+
+    size_t aggregate_top = 0;
+
+    for (const ASTImpl::Instruction& instruction : program_) {
+        switch (instruction.code) {
+            case OpCode::PushNumber:
+                stack[top++] = instruction.operand.number;
+                break;
+            case OpCode::LoadCell: {
+                Position cell{instruction.operand.cell.row + shift.row,
+                              instruction.operand.cell.col + shift.col};
+                if (!cell.IsValid()) {
+                    return FormulaError::Category::Ref;
+                }
+                FormulaInterface::Value value = ASTImpl::ReadCellAsNumber(sheet, cell);
+                if (std::holds_alternative<FormulaError>(value)) {
+                    return value;
+                }
+                stack[top++] = std::get<double>(value);
+                break;
+            }
+            case OpCode::Add:
+                --top;
+                stack[top - 1] += stack[top];
+                break;
+            case OpCode::Subtract:
+                --top;
+                stack[top - 1] -= stack[top];
+                break;
+            case OpCode::Multiply:
+                --top;
+                stack[top - 1] *= stack[top];
+                break;
+            case OpCode::Divide:
+                --top;
+                stack[top - 1] /= stack[top];
+                if (!std::isfinite(stack[top - 1])) {
+                    return FormulaError::Category::Arithmetic;
+                }
+                break;
+            case OpCode::Negate:
+                stack[top - 1] = -stack[top - 1];
+                break;
+            case OpCode::BeginAggregate:
+                accumulators[aggregate_top++] = RangeAccumulator{};
+                break;
+            case OpCode::AccumulateRange: {
+                const ASTImpl::RangeRef& ref = instruction.operand.range;
+                Range range{{ref.first.row + shift.row, ref.first.col + shift.col},
+                            {ref.last.row + shift.row, ref.last.col + shift.col}};
+                if (!range.IsValid()) {
+                    return FormulaError::Category::Ref;
+                }
+                auto error = sheet.AccumulateRange(range, accumulators[aggregate_top - 1]);
+                if (error) {
+                    return *error;
+                }
+                break;
+            }
+            case OpCode::AccumulateValue:
+                accumulators[aggregate_top - 1].Add(stack[--top]);
+                break;
+            case OpCode::EndAggregate: {
+                FormulaInterface::Value value = ASTImpl::FinishAggregate(
+                    instruction.operand.function, accumulators[--aggregate_top]);
+                if (std::holds_alternative<FormulaError>(value)) {
+                    return value;
+                }
+                stack[top++] = std::get<double>(value);
+                break;
+            }
+        }
     }
-    
-    throw FormulaException("Error! (FormulaAST::Execute())");
+
+    assert(top == 1);
+    return stack[0];
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
+bool FormulaAST::ExecuteColumn(const SheetInterface& sheet, Position shift, size_t count,
+                               FormulaInterface::Value* results) const {
+    using ASTImpl::OpCode;
+    constexpr size_t LANES = COLUMN_BATCH_SIZE;
+    assert(count <= LANES);
+
+    if (max_aggregate_depth_ > 0) {
+        // each copy accumulates its own ranges, there is nothing to share
+        return false;
+    }
+
+    // the stack holds a lane array per entry
+    constexpr size_t INLINE_STACK_DEPTH = 8;
+    double inline_stack[INLINE_STACK_DEPTH * LANES];
+    std::vector<double> heap_stack;
+    double* stack = inline_stack;
+
+    if (max_stack_depth_ > INLINE_STACK_DEPTH) {
+        heap_stack.resize(max_stack_depth_ * LANES);
+        stack = heap_stack.data();
+    }
+
+    auto lanes = [&](size_t depth) {
+        return stack + depth * LANES;
+    };
+
+    // a division that goes wrong in one copy only fails that copy
+    bool arithmetic_error[LANES] = {};
+    size_t top = 0;
+
+    for (const ASTImpl::Instruction& instruction : program_) {
+        switch (instruction.code) {
+            case OpCode::PushNumber:
+                std::fill(lanes(top), lanes(top) + count, instruction.operand.number);
+                ++top;
+                break;
+            case OpCode::LoadCell: {
+                Position first{instruction.operand.cell.row + shift.row,
+                               instruction.operand.cell.col + shift.col};
+                if (!sheet.GetNumericColumn(first, count, lanes(top))) {
+                    return false;
+                }
+                ++top;
+                break;
+            }
+            case OpCode::Add: {
+                --top;
+                double* lhs = lanes(top - 1);
+                const double* rhs = lanes(top);
+                for (size_t i = 0; i < count; ++i) {
+                    lhs[i] += rhs[i];
+                }
+                break;
+            }
+            case OpCode::Subtract: {
+                --top;
+                double* lhs = lanes(top - 1);
+                const double* rhs = lanes(top);
+                for (size_t i = 0; i < count; ++i) {
+                    lhs[i] -= rhs[i];
+                }
+                break;
+            }
+            case OpCode::Multiply: {
+                --top;
+                double* lhs = lanes(top - 1);
+                const double* rhs = lanes(top);
+                for (size_t i = 0; i < count; ++i) {
+                    lhs[i] *= rhs[i];
+                }
+                break;
+            }
+            case OpCode::Divide: {
+                --top;
+                double* lhs = lanes(top - 1);
+                const double* rhs = lanes(top);
+                for (size_t i = 0; i < count; ++i) {
+                    lhs[i] /= rhs[i];
+                    arithmetic_error[i] |= !std::isfinite(lhs[i]);
+                }
+                break;
+            }
+            case OpCode::Negate: {
+                double* operand = lanes(top - 1);
+                for (size_t i = 0; i < count; ++i) {
+                    operand[i] = -operand[i];
+                }
+                break;
+            }
+            default:
+                assert(false);
+                return false;
+        }
+    }
+
+    assert(top == 1);
+    const double* values = lanes(0);
+
+    for (size_t i = 0; i < count; ++i) {
+        if (arithmetic_error[i] || !std::isfinite(values[i])) {
+            results[i] = FormulaError::Category::Arithmetic;
+        } else {
+            results[i] = values[i];
+        }
+    }
+
+    return true;
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<std::pmr::monotonic_buffer_resource> arena,
+                       ASTImpl::ExprPtr root_expr, ASTImpl::CellList cells,
+                       ASTImpl::RangeList ranges)
+    : arena_(std::move(arena))
+    , root_expr_(std::move(root_expr))
+    , program_(arena_.get())
+    , cells_(std::move(cells))
+    , ranges_(std::move(ranges)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+
+    // the program is compiled in a stack buffer first, so that the arena
+    // gets only the final program and not every size it grew through
+    alignas(ASTImpl::Instruction) std::byte scratch_buffer[2048];
+    std::pmr::monotonic_buffer_resource scratch(scratch_buffer, sizeof(scratch_buffer),
+                                                arena_.get());
+    ASTImpl::Program program(&scratch);
+    ASTImpl::CompileValue(*root_expr_, program);
+    program_.reserve(program.size());
+    program_.assign(program.begin(), program.end());
+
+    size_t depth = 0;
+    size_t aggregate_depth = 0;
+    for (const ASTImpl::Instruction& instruction : program_) {
+        switch (instruction.code) {
+            case ASTImpl::OpCode::PushNumber:
+            case ASTImpl::OpCode::LoadCell:
+                max_stack_depth_ = std::max(max_stack_depth_, ++depth);
+                break;
+            case ASTImpl::OpCode::Negate:
+            case ASTImpl::OpCode::AccumulateRange:
+                break;
+            case ASTImpl::OpCode::BeginAggregate:
+                max_aggregate_depth_ = std::max(max_aggregate_depth_, ++aggregate_depth);
+                break;
+            case ASTImpl::OpCode::EndAggregate:
+                --aggregate_depth;
+                max_stack_depth_ = std::max(max_stack_depth_, ++depth);
+                break;
+            default:
+                --depth;
+                break;
+        }
+    }
 }
 
 FormulaAST::~FormulaAST() = default;
@@ -1,15 +1,76 @@
 #pragma once
 
-#include "FormulaLexer.h"
+#include "arena.h"
 #include "common.h"
 #include "sheet.h"
 
+#include <cstdint>
 #include <forward_list>
 #include <functional>
+#include <iosfwd>
+#include <memory>
+#include <memory_resource>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
 namespace ASTImpl {
 class Expr;
+using ExprPtr = PoolPtr<Expr>;
+
+// Formulas are evaluated from a flat postfix program rather than by
+// walking the tree: operands are pushed onto a value stack and operators
+// replace the top values with the result.
+//
+// Aggregate functions keep a separate stack of accumulators: BeginAggregate
+// opens one, AccumulateRange and AccumulateValue fold a range or the top
+// value into it, and EndAggregate closes it and pushes the result.
+enum class OpCode : std::uint8_t {
+    PushNumber,
+    LoadCell,
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Negate,
+    BeginAggregate,
+    AccumulateRange,
+    AccumulateValue,
+    EndAggregate,
+};
+
+enum class AggregateFunction : std::uint8_t {
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+};
+
+struct CellRef {
+    int row;
+    int col;
+};
+
+struct RangeRef {
+    CellRef first;
+    CellRef last;
+};
+
+struct Instruction {
+    OpCode code;
+    union {
+        double number;
+        CellRef cell;
+        RangeRef range;
+        AggregateFunction function;
+    } operand;
+};
+
+// the program and the reference lists live in the arena of their AST
+using Program = std::pmr::vector<Instruction>;
+using CellList = std::pmr::forward_list<Position>;
+using RangeList = std::pmr::forward_list<Range>;
 }
 
 class ParsingError : public std::runtime_error {
@@ -18,32 +79,69 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+    // the nodes of root_expr, cells and ranges must be allocated from arena,
+    // which the AST takes over and releases in one go
+    FormulaAST(std::unique_ptr<std::pmr::monotonic_buffer_resource> arena,
+               ASTImpl::ExprPtr root_expr, ASTImpl::CellList cells, ASTImpl::RangeList ranges);
+    // the containers keep pointing to the arena, which moves along with them;
+    // an assignment would free the arena of the target under its containers
     FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    FormulaAST& operator=(FormulaAST&&) = delete;
     ~FormulaAST();
 
-    double Execute(const SheetInterface& sheet) const;
+    // Returns the value of the formula or the first error met while
+    // evaluating it; never throws.
+    //
+    // shift moves every reference by shift.row rows and shift.col columns,
+    // which is how cells filled from one formula share a single AST. A
+    // reference shifted off the sheet evaluates to #REF!.
+    FormulaInterface::Value Execute(const SheetInterface& sheet, Position shift = {0, 0}) const;
+
+    // Evaluates count <= COLUMN_BATCH_SIZE copies of the formula going down
+    // a column at once: copy i is shifted by shift plus i rows. Each
+    // instruction runs over all copies as a plain loop over a lane array,
+    // which the compiler turns into SIMD code. Returns false without
+    // touching results when the batch cannot be run this way (aggregates, a
+    // reference off the sheet or to a cell that is not a number), and the
+    // caller falls back to Execute() per copy.
+    bool ExecuteColumn(const SheetInterface& sheet, Position shift, size_t count,
+                       FormulaInterface::Value* results) const;
+
+    static constexpr size_t COLUMN_BATCH_SIZE = 64;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    void PrintFormula(std::ostream& out, Position shift = {0, 0}) const;
 
-    std::forward_list<Position>& GetCells() {
+    ASTImpl::CellList& GetCells() {
         return cells_;
     }
 
-    const std::forward_list<Position>& GetCells() const {
+    const ASTImpl::CellList& GetCells() const {
         return cells_;
     }
 
+    // ranges passed to aggregate functions, in the order of the formula
+    const ASTImpl::RangeList& GetRanges() const {
+        return ranges_;
+    }
+
+    // the optimized postfix program that Execute() runs
+    const ASTImpl::Program& GetProgram() const {
+        return program_;
+    }
+
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    std::unique_ptr<std::pmr::monotonic_buffer_resource> arena_;
+    ASTImpl::ExprPtr root_expr_;
+    ASTImpl::Program program_;
+    size_t max_stack_depth_ = 0;
+    size_t max_aggregate_depth_ = 0;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
-    std::forward_list<Position> cells_;
+    ASTImpl::CellList cells_;
+    ASTImpl::RangeList ranges_;
     //const Sheet& sheet_;
 };
 
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Удаляет объект, созданный функцией MakePooled, и возвращает память тому
+// memory_resource, из которого она была взята. Помнит размер исходного
+// объекта, поэтому подходит и для указателя на базовый класс.
+template <typename T>
+class PoolDeleter
+{
+public:
+    PoolDeleter() = default;
+
+    PoolDeleter(std::pmr::memory_resource* resource, size_t size, size_t alignment)
+    :resource_(resource), size_(size), alignment_(alignment){}
+
+    template <typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+    PoolDeleter(const PoolDeleter<U>& other)
+    :resource_(other.GetResource()), size_(other.GetSize()), alignment_(other.GetAlignment()){}
+
+    void operator()(T* ptr) const
+    {
+        void* memory = ptr;
+
+        if constexpr(std::is_polymorphic_v<T>)
+        {
+            memory = dynamic_cast<void*>(ptr);
+        }
+
+        ptr->~T();
+        resource_->deallocate(memory, size_, alignment_);
+    }
+
+    std::pmr::memory_resource* GetResource() const
+    {
+        return resource_;
+    }
+
+    size_t GetSize() const
+    {
+        return size_;
+    }
+
+    size_t GetAlignment() const
+    {
+        return alignment_;
+    }
+
+private:
+    std::pmr::memory_resource* resource_ = nullptr;
+    size_t size_ = 0;
+    size_t alignment_ = 0;
+};
+
+template <typename T>
+using PoolPtr = std::unique_ptr<T, PoolDeleter<T>>;
+
+// Размещает объект в переданном memory_resource
+template <typename T, typename... Args>
+PoolPtr<T> MakePooled(std::pmr::memory_resource* resource, Args&&... args)
+{
+    void* memory = resource->allocate(sizeof(T), alignof(T));
+
+    try
+    {
+        T* object = new (memory) T(std::forward<Args>(args)...);
+        return PoolPtr<T>(object, PoolDeleter<T>(resource, sizeof(T), alignof(T)));
+    }
+    catch(...)
+    {
+        resource->deallocate(memory, sizeof(T), alignof(T));
+        throw;
+    }
+}
@@ -2,149 +2,123 @@
 
 #include "common.h"
 #include "formula.h"
-#include "sheet.h"
+
+#include <cstdint>
+#include <cstring>
 
 class Sheet;
 
-class Cell : public CellInterface 
+// Компактное содержимое ячейки - ровно 8 байт.
+// Число хранится как обычный double. Остальные виды содержимого кодируются
+// внутри NaN, который не может получиться из числового текста: в старших
+// 16 битах все единицы, затем тег и 32-битный дескриптор текста или формулы.
+class CellSlot
 {
 public:
-    Cell(const SheetInterface& sheet);
-    ~Cell();
+    enum class Tag : std::uint16_t
+    {
+        Number,
+        None,     // ячейки нет
+        Empty,    // ячейка с пустым текстом
+        Text,     // дескриптор строки в TextPool таблицы
+        Formula,  // дескриптор формулы в таблице
+    };
 
-    void Set(std::string text);
-    void SetPos(Position pos);
-    void SetRef(bool state) const;
-    void Clear();
+    CellSlot() = default;
 
-    Value GetValue() const override;
-    std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
+    static CellSlot MakeNumber(double number)
+    {
+        CellSlot slot;
+        std::memcpy(&slot.bits_, &number, sizeof(number));
+        return slot;
+    }
 
-    bool IsReferenced() const;
+    static CellSlot MakeEmpty()
+    {
+        return Box(Tag::Empty, 0);
+    }
 
-private:
+    static CellSlot MakeText(std::uint32_t handle)
+    {
+        return Box(Tag::Text, handle);
+    }
 
-    class Impl
+    static CellSlot MakeFormula(std::uint32_t handle)
     {
-        public:
-        
-        virtual Value GetValue() const
-        {
-            return "";
-        }
-        
-        virtual std::string GetText() const
-        {
-            return "";
-        }
-    };
-    
-    class EmptyImpl : public Impl
+        return Box(Tag::Formula, handle);
+    }
+
+    // Слот из сырого представления, например прочитанного из снимка
+    static CellSlot FromBits(std::uint64_t bits)
     {
-        public:
-        
-        EmptyImpl() = default;
-        
-        Value GetValue() const override
-        {
-            return "";
-        }
-        
-        std::string GetText() const override
-        {
-            return "";
-        }
-    };
-    
-    class TextImpl : public Impl
+        CellSlot slot;
+        slot.bits_ = bits;
+        return slot;
+    }
+
+    Tag GetTag() const
     {
-        public:
-        
-        TextImpl() = default;
-        
-        TextImpl(std::string& text)
+        if((bits_ & BOX_MASK) != BOX_MASK)
         {
-            value_ = std::move(text);
+            return Tag::Number;
         }
-                
-        void SetValue(std::string& text)
-        {
-            value_ = std::move(text);
-        }
-        
-        Value GetValue() const override
-        {
-            if(value_[0] == '\'')
-            {
-                std::string tmp(value_.begin() + 1, value_.end());
-                return tmp;
-            }
-            
-            return value_;
-        }
-        
-        std::string GetText() const override
-        {
-            return value_;
-        }
-        
-        private:
-        std::string value_;
-    };
-    
-    class FormulaImpl : public Impl
+
+        return static_cast<Tag>((bits_ >> 32) & 0xFFFF);
+    }
+
+    bool IsNone() const
     {
-        public:
-        
-        FormulaImpl(const SheetInterface& sheet)
-        :sheet_(sheet){}
-        
-        FormulaImpl(const SheetInterface& sheet, std::string& text)
-        :sheet_(sheet){
-            value_ = std::move(text);
-        }
-                
-        void SetValue(std::string& text)
-        {
-            value_ = std::move(text);
-        }
-        
-        Value GetValue() const override
-        {
-            std::string tmp(value_.begin() + 1, value_.end());
-            
-            if(tmp.size() == 0)
-                return value_;
-            
-            std::unique_ptr<FormulaInterface> formula = ParseFormula(tmp);
-            std::variant<double, FormulaError> result = formula->Evaluate(sheet_);
-            
-            if(std::holds_alternative<double>(result))
-            {
-                return std::get<double>(result);
-            }
-            else
-            {
-                return std::get<FormulaError>(result);
-            }
-            
-        }
-        
-        std::string GetText() const override
-        {
-            return value_;
-        }
-        
-        private:
-        std::string value_;
-        const SheetInterface& sheet_;
-    };
-    
-    std::unique_ptr<Impl> impl_;
-    
-    mutable bool is_referenced_ = false;
-    
-    const SheetInterface& sheet_;
-    Position current_pos_ = {-1, -1};
-};
\ No newline at end of file
+        return bits_ == NONE_BITS;
+    }
+
+    double GetNumber() const
+    {
+        double number;
+        std::memcpy(&number, &bits_, sizeof(number));
+        return number;
+    }
+
+    std::uint32_t GetHandle() const
+    {
+        return static_cast<std::uint32_t>(bits_);
+    }
+
+    // Сырое представление - для векторных ядер, которые разбирают слоты
+    // сразу пачкой
+    std::uint64_t GetBits() const
+    {
+        return bits_;
+    }
+
+private:
+    static constexpr std::uint64_t BOX_MASK = 0xFFFF000000000000ull;
+    static constexpr std::uint64_t NONE_BITS = BOX_MASK | (std::uint64_t(Tag::None) << 32);
+
+    static CellSlot Box(Tag tag, std::uint32_t handle)
+    {
+        CellSlot slot;
+        slot.bits_ = BOX_MASK | (std::uint64_t(tag) << 32) | handle;
+        return slot;
+    }
+
+    std::uint64_t bits_ = NONE_BITS;
+};
+
+static_assert(sizeof(CellSlot) == 8);
+
+// Ячейка, которую возвращает Sheet::GetCell(). Сама ничего не хранит и
+// обращается к таблице по своей позиции; создаётся только по запросу и
+// живёт, пока ячейка не очищена.
+class Cell : public CellInterface
+{
+public:
+    Cell(const Sheet& sheet, Position pos);
+
+    Value GetValue() const override;
+    std::string GetText() const override;
+    std::vector<Position> GetReferencedCells() const override;
+
+private:
+    const Sheet& sheet_;
+    Position pos_;
+};
@@ -0,0 +1,70 @@
+#include "column_aggregates.h"
+
+#include <algorithm>
+
+void ColumnAggregateTree::Set(int row, const ColumnSummary& leaf)
+{
+    if(static_cast<size_t>(row) >= leaves_)
+    {
+        Grow(row);
+    }
+
+    size_t node = leaves_ + static_cast<size_t>(row);
+    nodes_[node] = leaf;
+
+    for(node >>= 1; node > 0; node >>= 1)
+    {
+        nodes_[node] = ColumnSummary::Combine(nodes_[2 * node], nodes_[2 * node + 1]);
+    }
+}
+
+ColumnSummary ColumnAggregateTree::Query(int first_row, int last_row) const
+{
+    ColumnSummary result;
+
+    // Строки ниже последнего листа пусты
+    if(static_cast<size_t>(first_row) >= leaves_)
+    {
+        return result;
+    }
+
+    size_t last = std::min(static_cast<size_t>(last_row), leaves_ - 1);
+    size_t left = leaves_ + static_cast<size_t>(first_row);
+    size_t right = leaves_ + last + 1;
+
+    for(; left < right; left >>= 1, right >>= 1)
+    {
+        if(left & 1)
+        {
+            result = ColumnSummary::Combine(result, nodes_[left++]);
+        }
+
+        if(right & 1)
+        {
+            result = ColumnSummary::Combine(result, nodes_[--right]);
+        }
+    }
+
+    return result;
+}
+
+void ColumnAggregateTree::Grow(int row)
+{
+    size_t leaves = std::max(leaves_, MIN_LEAVES);
+
+    while(leaves <= static_cast<size_t>(row))
+    {
+        leaves *= 2;
+    }
+
+    std::vector<ColumnSummary> nodes(2 * leaves);
+    std::copy(nodes_.begin() + leaves_, nodes_.end(), nodes.begin() + leaves);
+
+    for(size_t node = leaves - 1; node > 0; --node)
+    {
+        nodes[node] = ColumnSummary::Combine(nodes[2 * node], nodes[2 * node + 1]);
+    }
+
+    nodes_ = std::move(nodes);
+    leaves_ = leaves;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Итог по отрезку строк одного столбца. unknown - число ячеек, вклад которых
+// в дереве не известен (формулы с ошибкой или ждущие пересчёта): если такие
+// есть, итогу верить нельзя и столбец нужно обойти честно.
+struct ColumnSummary
+{
+    double sum = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    std::uint32_t count = 0;
+    std::uint32_t unknown = 0;
+
+    static ColumnSummary Number(double value)
+    {
+        return {value, value, value, 1, 0};
+    }
+
+    static ColumnSummary Unknown()
+    {
+        ColumnSummary summary;
+        summary.unknown = 1;
+        return summary;
+    }
+
+    static ColumnSummary Combine(const ColumnSummary& lhs, const ColumnSummary& rhs)
+    {
+        return {lhs.sum + rhs.sum,
+                lhs.min < rhs.min ? lhs.min : rhs.min,
+                lhs.max > rhs.max ? lhs.max : rhs.max,
+                lhs.count + rhs.count,
+                lhs.unknown + rhs.unknown};
+    }
+};
+
+// Дерево отрезков над строками столбца: изменение ячейки и итог SUM, COUNT,
+// MIN, MAX по любому отрезку строк - за O(log n). Сумма узла каждый раз
+// пересчитывается из детей, а не правится на разность, поэтому ошибки
+// округления не накапливаются от правки к правке.
+//
+// Листья заводятся только до последней записанной строки (с округлением до
+// степени двойки), и дерево удваивается, когда запись уходит ниже, так что
+// память пропорциональна занятой высоте столбца, а не Position::MAX_ROWS.
+class ColumnAggregateTree
+{
+public:
+    void Set(int row, const ColumnSummary& leaf);
+    ColumnSummary Query(int first_row, int last_row) const;
+
+private:
+    static constexpr size_t MIN_LEAVES = 64;
+
+    // Перестраивает дерево так, чтобы в нём была строка row
+    void Grow(int row);
+
+    // Корень - 1, дети узла i - 2i и 2i + 1, лист строки r - leaves_ + r
+    std::vector<ColumnSummary> nodes_;
+    size_t leaves_ = 0;
+};
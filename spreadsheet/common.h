@@ -1,7 +1,10 @@
 #pragma once
 
+#include <cstddef>
 #include <iosfwd>
+#include <limits>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -27,6 +30,23 @@ struct Position {
     static const Position NONE;
 };
 
+// Прямоугольная область ячеек: first - левый верхний угол, last - правый
+// нижний. Записывается как "A1:B2".
+struct Range {
+    Position first;
+    Position last;
+
+    bool operator==(Range rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    std::string ToString() const;
+
+    // Диапазон с теми же ячейками, но углами, приведёнными к first <= last
+    // по строкам и столбцам
+    static Range FromCorners(Position a, Position b);
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -121,6 +141,23 @@ public:
     virtual std::vector<Position> GetReferencedCells() const = 0;
 };
 
+// Промежуточный итог агрегатных функций (SUM, AVERAGE, MIN, MAX, COUNT) по
+// числам из одного или нескольких диапазонов
+struct RangeAccumulator {
+    double sum = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    size_t count = 0;
+
+    void Add(double value)
+    {
+        sum += value;
+        min = value < min ? value : min;
+        max = value > max ? value : max;
+        ++count;
+    }
+};
+
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
@@ -152,6 +189,19 @@ public:
     
     virtual CachedValue GetCachedValue(Position pos) const = 0;
     virtual std::vector<Position> GetReferencedPositions(Position pos) const = 0;
+    // Значение ячейки в том виде, в котором его читает формула: число либо
+    // ошибка. Пустая ячейка - ноль, нечисловой текст - ошибка #VALUE!
+    virtual std::variant<double, FormulaError> GetNumericValue(Position pos) const = 0;
+    // Добавляет к acc числовые значения ячеек диапазона. Пустые ячейки и
+    // нечисловой текст пропускаются. Если в диапазоне есть формула с ошибкой,
+    // возвращает эту ошибку.
+    virtual std::optional<FormulaError> AccumulateRange(Range range,
+                                                        RangeAccumulator& acc) const = 0;
+    // Читает числами count ячеек столбца, начиная с first и вниз, - для
+    // вычисления формул пачкой. Возвращает false, если хоть одна ячейка
+    // выходит за пределы таблицы или не читается числом без ошибки; тогда
+    // значения нужно читать по одной через GetNumericValue().
+    virtual bool GetNumericColumn(Position first, size_t count, double* values) const = 0;
     // Очищает ячейку.
     // Последующий вызов GetCell() для этой ячейки вернёт либо nullptr, либо
     // объект с пустым текстом.
@@ -162,8 +212,6 @@ public:
     // текстом.
     virtual Size GetPrintableSize() const = 0;
     
-    virtual void StoreCache(Position pos, CachedValue str) const = 0;
-    virtual void StoreRefs(Position pos, std::vector<Position> refs) const = 0;
     // Выводит всю таблицу в переданный поток. Столбцы разделяются знаком
     // табуляции. После каждой строки выводится символ перевода строки. Для
     // преобразования ячеек в строку используются методы GetValue() или GetText()
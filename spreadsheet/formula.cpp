@@ -1,13 +1,17 @@
 #include "formula.h"
 
 #include "FormulaAST.h"
+#include "small_vector.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <list>
+#include <mutex>
 #include <sstream>
-#include <set>
 #include <cmath>
+#include <string_view>
+#include <unordered_map>
 
 using namespace std::literals;
 
@@ -17,115 +21,318 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe)
 }
 
 namespace {
-class Formula : public FormulaInterface 
+// Разобранное выражение вместе с его ссылками. Его разделяют все копии
+// формулы, полученные протягиванием, а ссылки записаны так, как они выглядят
+// в исходной ячейке.
+struct ParsedFormula
 {
-    public:
-        explicit Formula(std::string expression) try
-        : ast_(ParseFormulaAST(expression)) 
+    explicit ParsedFormula(const std::string& expression)
+    : ast(ParseFormulaAST(expression))
+    {
+        // Ячейки AST уже отсортированы, остаётся убрать повторы
+        for(Position p : ast.GetCells())
         {
-            ParseRefs();
-        } 
-        catch (const std::exception& exc) 
+            if(refs.empty() || !(refs[refs.size() - 1] == p))
+            {
+                refs.push_back(p);
+            }
+        }
+        
+        for(const Range& range : ast.GetRanges())
         {
-            std::throw_with_nested(FormulaException(exc.what()));
+            ranges.push_back(range);
         }
+    }
+    
+    FormulaAST ast;
+    SmallVector<Position, 4> refs;
+    SmallVector<Range, 2> ranges;
+};
+
+std::shared_ptr<const ParsedFormula> Parse(const std::string& expression)
+{
+    try
+    {
+        return std::make_shared<ParsedFormula>(expression);
+    }
+    catch(const std::exception& exc)
+    {
+        std::throw_with_nested(FormulaException(exc.what()));
+    }
+}
+
+// Кэш разобранных выражений с вытеснением давно не использованных (LRU).
+// Разобранное выражение не меняется, поэтому одно и то же разделяют все
+// формулы с этим текстом - в любых таблицах и потоках. Разбор идёт без
+// блокировки: если два потока разберут один текст одновременно, в кэше
+// останется один из результатов.
+class ParseCache
+{
+public:
+    std::shared_ptr<const ParsedFormula> GetOrParse(std::string_view expression)
+    {
+        std::string_view key = Normalize(expression);
         
-        Value Evaluate(const SheetInterface& sheet) const override
         {
-            ParseRefs();
+            std::lock_guard lock(mutex_);
             
-            for(auto& entry : refs_)
+            if(capacity_ > 0)
             {
-                auto val = sheet.GetCachedValue(entry); 
+                auto it = index_.find(key);
                 
-                if(std::holds_alternative<FormulaError>(val))
+                if(it != index_.end())
                 {
-                    return std::get<FormulaError>(val);
+                    ++hits_;
+                    entries_.splice(entries_.begin(), entries_, it->second);
+                    return it->second->parsed;
                 }
             }
             
-            try
+            ++misses_;
+        }
+        
+        std::shared_ptr<const ParsedFormula> parsed = Parse(std::string(key));
+        
+        std::lock_guard lock(mutex_);
+        
+        if(capacity_ > 0 && index_.count(key) == 0)
+        {
+            entries_.push_front({std::string(key), parsed});
+            index_.emplace(entries_.front().text, entries_.begin());
+            Shrink();
+        }
+        
+        return parsed;
+    }
+    
+    void SetCapacity(size_t capacity)
+    {
+        std::lock_guard lock(mutex_);
+        capacity_ = capacity;
+        Shrink();
+    }
+    
+    FormulaCacheStats GetStats() const
+    {
+        std::lock_guard lock(mutex_);
+        return {hits_, misses_, entries_.size(), capacity_};
+    }
+    
+private:
+    struct Entry
+    {
+        std::string text;
+        std::shared_ptr<const ParsedFormula> parsed;
+    };
+    
+    // Пробелы по краям парсер всё равно пропускает, а внутри выражения
+    // они могут разделять лексемы, поэтому остаются
+    static std::string_view Normalize(std::string_view expression)
+    {
+        const std::string_view SPACES = " \t\n\r";
+        size_t begin = expression.find_first_not_of(SPACES);
+        
+        if(begin == std::string_view::npos)
+        {
+            return {};
+        }
+        
+        return expression.substr(begin, expression.find_last_not_of(SPACES) - begin + 1);
+    }
+    
+    void Shrink()
+    {
+        while(entries_.size() > capacity_)
+        {
+            index_.erase(entries_.back().text);
+            entries_.pop_back();
+        }
+    }
+    
+    mutable std::mutex mutex_;
+    // От недавно использованных к давним; ключи индекса указывают на
+    // строки в списке, которые при перестановках не перемещаются
+    std::list<Entry> entries_;
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+    size_t capacity_ = DEFAULT_FORMULA_CACHE_CAPACITY;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+};
+
+ParseCache& GetParseCache()
+{
+    static ParseCache cache;
+    return cache;
+}
+
+class Formula : public FormulaInterface 
+{
+    public:
+        Formula(std::shared_ptr<const ParsedFormula> parsed, Position shift)
+        : parsed_(std::move(parsed)), shift_(shift)
+        {}
+        
+        // Не выделяет память: ссылки посчитаны при разборе, а значения
+        // ячеек читаются без копирования. Ошибка ячейки, на которую
+        // ссылается формула, возвращается виртуальной машиной при чтении.
+        Value Evaluate(const SheetInterface& sheet) const override
+        {
+            return EvaluateShifted(sheet, shift_);
+        }
+        
+        // Копии разбиваются на пачки по строкам; пачка, которую нельзя
+        // вычислить целиком, считается по одной копии
+        void EvaluateColumn(const SheetInterface& sheet, size_t count, Value* results) const override
+        {
+            for(size_t begin = 0; begin < count; begin += FormulaAST::COLUMN_BATCH_SIZE)
             {
-                Value result = ast_.Execute(sheet);
+                size_t batch = std::min(count - begin, FormulaAST::COLUMN_BATCH_SIZE);
+                Position shift{shift_.row + static_cast<int>(begin), shift_.col};
                 
-                if(std::holds_alternative<double>(result))
+                if(parsed_->ast.ExecuteColumn(sheet, shift, batch, results + begin))
                 {
-                    if(!std::isfinite(std::get<double>(result)))
-                    {
-                        return FormulaError::Category::Arithmetic;
-                    }
+                    continue;
                 }
                 
-                return result;
+                for(size_t i = 0; i < batch; ++i)
+                {
+                    results[begin + i] = EvaluateShifted(sheet, {shift.row + static_cast<int>(i),
+                                                                 shift.col});
+                }
+            }
+        }
+        
+        std::string GetExpression() const override 
+        {
+            std::ostringstream ss;
+            parsed_->ast.PrintFormula(ss, shift_);
+            return ss.str();
+        }
+    
+        std::vector<Position> GetReferencedCells() const override
+        {
+            std::vector<Position> refs = GetSingleCellReferences();
+            std::vector<Range> ranges = GetReferencedRanges();
+            
+            if(ranges.empty())
+            {
+                return refs;
             }
-            catch ( const FormulaException& e )
+            
+            for(const Range& range : ranges)
             {
-                
-                switch(e.what()[1])
+                for(int row = range.first.row; row <= range.last.row; ++row)
                 {
-                    case 'A':
-                        return FormulaError::Category::Arithmetic;
-                        break;
-                    
-                    case 'R':
-                        return FormulaError::Category::Ref;
-                        break;
-                    
-                    case 'V':
-                        return FormulaError::Category::Value;
-                        break;
-                        
-                    default:
-                        return FormulaError::Category::Ref;
-                        break;
+                    for(int col = range.first.col; col <= range.last.col; ++col)
+                    {
+                        refs.push_back({row, col});
+                    }
                 }
-                
             }
-            catch ( const FormulaError& e )
+            
+            std::sort(refs.begin(), refs.end());
+            refs.erase(std::unique(refs.begin(), refs.end()), refs.end());
+            
+            return refs;
+        }
+        
+        // Сдвиг сохраняет порядок ячеек, так что результат остаётся
+        // отсортированным
+        std::vector<Position> GetSingleCellReferences() const override
+        {
+            std::vector<Position> refs;
+            refs.reserve(parsed_->refs.size());
+            
+            for(Position ref : parsed_->refs)
             {
-                return e;
+                Position shifted = ShiftPosition(ref);
+                
+                if(shifted.IsValid())
+                {
+                    refs.push_back(shifted);
+                }
             }
-            catch(...)
+            
+            return refs;
+        }
+        
+        std::vector<Range> GetReferencedRanges() const override
+        {
+            std::vector<Range> ranges;
+            ranges.reserve(parsed_->ranges.size());
+            
+            for(const Range& range : parsed_->ranges)
             {
-                return FormulaError::Category::Arithmetic;
+                Range shifted{ShiftPosition(range.first), ShiftPosition(range.last)};
+                
+                if(shifted.IsValid())
+                {
+                    ranges.push_back(shifted);
+                }
             }
-
+            
+            return ranges;
         }
         
-        std::string GetExpression() const override 
+        std::unique_ptr<FormulaInterface> Shift(int row_shift, int col_shift) const override
         {
-            std::ostringstream ss;
-            ast_.PrintFormula(ss);
-            return ss.str();
+            return std::make_unique<Formula>(parsed_, Position{shift_.row + row_shift,
+                                                               shift_.col + col_shift});
         }
-    
-        std::vector<Position> GetReferencedCells() const
+        
+        bool IsShiftOf(const FormulaInterface& origin, int row_shift, int col_shift) const override
+        {
+            const Formula* other = dynamic_cast<const Formula*>(&origin);
+            
+            return other != nullptr && other->parsed_ == parsed_
+                && shift_.row == other->shift_.row + row_shift
+                && shift_.col == other->shift_.col + col_shift;
+        }
+        
+        Position GetShift() const override
         {
-            return refs_;
+            return shift_;
         }
         
     private:
-    
-        void ParseRefs() const
+        Value EvaluateShifted(const SheetInterface& sheet, Position shift) const
         {
-            std::set<Position> checker;
-            for(Position p : ast_.GetCells())
+            Value result = parsed_->ast.Execute(sheet, shift);
+            
+            if(std::holds_alternative<double>(result))
             {
-                if(checker.find(p) == checker.end())
+                if(!std::isfinite(std::get<double>(result)))
                 {
-                    checker.insert(p);
-                    refs_.push_back(p);
+                    return FormulaError::Category::Arithmetic;
                 }
             }
+            
+            return result;
         }
         
-        FormulaAST ast_;
-        mutable std::vector<Position> refs_;
+        Position ShiftPosition(Position pos) const
+        {
+            return {pos.row + shift_.row, pos.col + shift_.col};
+        }
+        
+        std::shared_ptr<const ParsedFormula> parsed_;
+        // Смещение этой копии относительно ячейки, в которой формула была
+        // разобрана
+        Position shift_;
     };
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) 
 {
-    return std::make_unique<Formula>(std::move(expression));
+    return std::make_unique<Formula>(GetParseCache().GetOrParse(expression), Position{0, 0});
+}
+
+void SetFormulaCacheCapacity(size_t capacity)
+{
+    GetParseCache().SetCapacity(capacity);
 }
 
+FormulaCacheStats GetFormulaCacheStats()
+{
+    return GetParseCache().GetStats();
+}
@@ -9,6 +9,9 @@
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Агрегатные функции над диапазонами и значениями: SUM(A1:A100,B1*2),
+//   AVERAGE, MIN, MAX, COUNT. Пустые ячейки и нечисловой текст в диапазонах
+//   пропускаются.
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -33,10 +36,56 @@ public:
 
     // Возвращает список ячеек, которые непосредственно задействованы в вычислении
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
+    // ячеек. Ячейки диапазонов перечисляются поштучно.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Ссылки без раскрытия диапазонов: ячейки, указанные в формуле по
+    // отдельности (отсортированы, без повторов), и диапазоны агрегатных
+    // функций. По ним строится граф зависимостей таблицы.
+    virtual std::vector<Position> GetSingleCellReferences() const = 0;
+    virtual std::vector<Range> GetReferencedRanges() const = 0;
+    
+    // Возвращает ту же формулу, скопированную на row_shift строк и col_shift
+    // столбцов: все ссылки сдвигаются вместе с ней, как при протягивании.
+    // Разобранное выражение не копируется, а разделяется всеми копиями.
+    // Ссылки, ушедшие за пределы таблицы, становятся #REF! и в граф
+    // зависимостей не попадают.
+    virtual std::unique_ptr<FormulaInterface> Shift(int row_shift, int col_shift) const = 0;
+    
+    // Получена ли эта формула из origin сдвигом на row_shift строк и
+    // col_shift столбцов, то есть разделяет ли она с ней выражение
+    virtual bool IsShiftOf(const FormulaInterface& origin, int row_shift, int col_shift) const = 0;
+    
+    // Сдвиг этой копии относительно ячейки, в которой выражение было
+    // разобрано: {0, 0} у результата ParseFormula(). Shift(-row, -col)
+    // возвращает формулу с исходным текстом выражения.
+    virtual Position GetShift() const = 0;
+    
+    // Вычисляет сразу count копий формулы, идущих по столбцу: эту и сдвинутые
+    // на 1, 2, ..., count - 1 строк вниз. results[i] совпадает с тем, что
+    // вернул бы Evaluate() i-й копии.
+    virtual void EvaluateColumn(const SheetInterface& sheet, size_t count, Value* results) const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+// Разобранные выражения кэшируются по тексту (без пробелов по краям), так
+// что формулы с одинаковым текстом разбираются один раз и разделяют
+// выражение.
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Статистика кэша разобранных выражений за всё время работы программы
+struct FormulaCacheStats
+{
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t size = 0;
+    size_t capacity = 0;
+};
+
+inline constexpr size_t DEFAULT_FORMULA_CACHE_CAPACITY = 4096;
+
+// Задаёт, сколько выражений хранит кэш; лишние, давно не использованные,
+// вытесняются. 0 выключает кэш.
+void SetFormulaCacheCapacity(size_t capacity);
+FormulaCacheStats GetFormulaCacheStats();
\ No newline at end of file
@@ -0,0 +1,379 @@
+#include "journal.h"
+
+#include "snapshot.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#if __has_include(<unistd.h>)
+#include <fcntl.h>
+#include <unistd.h>
+#define JOURNAL_HAS_FSYNC 1
+#endif
+
+namespace
+{
+const char MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'W', 'A', 'L'};
+const std::uint32_t VERSION = 1;
+const std::uint32_t ENDIAN_MARK = 0x01020304;
+const size_t HEADER_SIZE = sizeof(MAGIC) + 2 * sizeof(std::uint32_t);
+
+// Длина тела и контрольная сумма перед каждой записью
+const size_t RECORD_PREFIX = 2 * sizeof(std::uint32_t);
+// Вид операции, строка и столбец в начале тела
+const size_t BODY_PREFIX = 1 + 2 * sizeof(std::uint32_t);
+// Сдвиг формулы после них
+const size_t SHIFT_SIZE = 2 * sizeof(std::int32_t);
+
+// Дальше Append() ждёт, пока фоновый поток не догонит
+const size_t MAX_PENDING = 1 << 26;
+
+template <typename T>
+void AppendValue(std::string& out, T value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T ReadValue(const char* data)
+{
+    T value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+std::uint32_t RecordChecksum(std::string_view body)
+{
+    return static_cast<std::uint32_t>(SnapshotChecksum(body));
+}
+
+std::string MakeHeader()
+{
+    std::string header(MAGIC, sizeof(MAGIC));
+    AppendValue(header, VERSION);
+    AppendValue(header, ENDIAN_MARK);
+    return header;
+}
+
+// Разбирает записи data, начиная после заголовка. Возвращает длину
+// целой части файла: запись, которая обрывается или не сходится с
+// контрольной суммой, и всё после неё считаются недописанными.
+size_t ReadRecords(std::string_view data, std::vector<JournalRecord>& records)
+{
+    size_t offset = HEADER_SIZE;
+
+    while(data.size() - offset >= RECORD_PREFIX)
+    {
+        std::uint32_t size = ReadValue<std::uint32_t>(data.data() + offset);
+        std::uint32_t checksum = ReadValue<std::uint32_t>(data.data() + offset + sizeof(size));
+
+        if(size < BODY_PREFIX || data.size() - offset - RECORD_PREFIX < size)
+        {
+            break;
+        }
+
+        std::string_view body = data.substr(offset + RECORD_PREFIX, size);
+
+        if(RecordChecksum(body) != checksum)
+        {
+            break;
+        }
+
+        auto kind = static_cast<JournalRecord::Kind>(body[0]);
+        Position pos{static_cast<int>(ReadValue<std::uint32_t>(body.data() + 1)),
+                     static_cast<int>(ReadValue<std::uint32_t>(body.data() + 1 + sizeof(std::uint32_t)))};
+
+        if((kind != JournalRecord::Kind::Set && kind != JournalRecord::Kind::Clear
+            && kind != JournalRecord::Kind::SetShifted) || !pos.IsValid())
+        {
+            break;
+        }
+
+        size_t text_begin = BODY_PREFIX;
+        Position shift{0, 0};
+
+        if(kind == JournalRecord::Kind::SetShifted)
+        {
+            if(size < BODY_PREFIX + SHIFT_SIZE)
+            {
+                break;
+            }
+
+            shift = {ReadValue<std::int32_t>(body.data() + BODY_PREFIX),
+                     ReadValue<std::int32_t>(body.data() + BODY_PREFIX + sizeof(std::int32_t))};
+            text_begin += SHIFT_SIZE;
+        }
+
+        records.push_back({kind, pos, std::string(body.substr(text_begin)), shift});
+        offset += RECORD_PREFIX + size;
+    }
+
+    return offset;
+}
+
+// Дописывает data в файл и сбрасывает его на диск
+void WriteDurably(std::FILE* file, std::string_view data)
+{
+    if(std::fwrite(data.data(), 1, data.size(), file) != data.size() || std::fflush(file) != 0)
+    {
+        throw std::runtime_error("Cannot write journal");
+    }
+
+#ifdef JOURNAL_HAS_FSYNC
+    if(::fsync(::fileno(file)) != 0)
+    {
+        throw std::runtime_error("Cannot sync journal");
+    }
+#endif
+}
+}
+
+Journal::Journal(const std::filesystem::path& path)
+:path_(path)
+{
+    std::error_code error;
+    std::uintmax_t size = std::filesystem::file_size(path, error);
+    size_t valid_size = 0;
+
+    if(!error && size > 0)
+    {
+        MappedFile file(path);
+        std::string_view data = file.GetData();
+        std::string header = MakeHeader();
+
+        // Обрывок заголовка остаётся от сбоя при создании журнала
+        if(data.size() < HEADER_SIZE && header.compare(0, data.size(), data) == 0)
+        {
+            size = 0;
+        }
+        else if(data.substr(0, HEADER_SIZE) != header)
+        {
+            throw std::runtime_error(path.string() + " is not a journal");
+        }
+        else
+        {
+            valid_size = ReadRecords(data, records_);
+        }
+    }
+
+    bool created = error || size == 0;
+
+    if(!created && valid_size < size)
+    {
+        std::filesystem::resize_file(path, valid_size);
+    }
+
+    file_ = std::fopen(path.string().c_str(), created ? "wb" : "ab");
+
+    if(file_ == nullptr)
+    {
+        throw std::runtime_error("Cannot open " + path.string());
+    }
+
+    if(created)
+    {
+        try
+        {
+            WriteDurably(file_, MakeHeader());
+        }
+        catch(...)
+        {
+            std::fclose(file_);
+            throw;
+        }
+    }
+
+    writer_ = std::thread([this]
+    {
+        WriterLoop();
+    });
+}
+
+Journal::~Journal()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+
+    wake_.notify_one();
+    writer_.join();
+
+    if(file_ != nullptr)
+    {
+        std::fclose(file_);
+    }
+}
+
+std::vector<JournalRecord> Journal::TakeRecords()
+{
+    return std::move(records_);
+}
+
+void Journal::Append(JournalRecord::Kind kind, Position pos, std::string_view text, Position shift)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    synced_.wait(lock, [this]
+    {
+        return pending_.size() < MAX_PENDING || !error_.empty();
+    });
+
+    // После ошибки на диск уже ничего не попадёт, её сообщит Sync()
+    if(!error_.empty())
+    {
+        return;
+    }
+
+    bool was_empty = pending_.empty();
+    size_t start = pending_.size();
+
+    bool shifted = kind == JournalRecord::Kind::SetShifted;
+
+    AppendValue(pending_, static_cast<std::uint32_t>(BODY_PREFIX + (shifted ? SHIFT_SIZE : 0) + text.size()));
+    AppendValue(pending_, std::uint32_t{0});
+    pending_ += static_cast<char>(kind);
+    AppendValue(pending_, static_cast<std::uint32_t>(pos.row));
+    AppendValue(pending_, static_cast<std::uint32_t>(pos.col));
+
+    if(shifted)
+    {
+        AppendValue(pending_, static_cast<std::int32_t>(shift.row));
+        AppendValue(pending_, static_cast<std::int32_t>(shift.col));
+    }
+
+    pending_ += text;
+
+    std::uint32_t checksum = RecordChecksum(std::string_view(pending_).substr(start + RECORD_PREFIX));
+    std::memcpy(pending_.data() + start + sizeof(std::uint32_t), &checksum, sizeof(checksum));
+
+    appended_ += pending_.size() - start;
+
+    // Занятый поток сам заберёт новые записи, когда допишет свои
+    if(was_empty)
+    {
+        wake_.notify_one();
+    }
+}
+
+void Journal::Sync()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::uint64_t target = appended_;
+
+    synced_.wait(lock, [this, target]
+    {
+        return durable_ >= target;
+    });
+
+    if(!error_.empty())
+    {
+        throw std::runtime_error(error_);
+    }
+}
+
+void Journal::Reset()
+{
+    Sync();
+
+    // Прежний журнал не обрезается на месте: при сбое посреди Reset() на
+    // диске остаётся либо он целиком, либо новый из одного заголовка.
+    // Фоновый поток трогает файл, только забрав записи под мьютексом, а
+    // после Sync() забирать нечего.
+    std::filesystem::path temp = path_;
+    temp += ".tmp";
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::FILE* file = std::fopen(temp.string().c_str(), "wb");
+
+    if(file == nullptr)
+    {
+        throw std::runtime_error("Cannot open " + temp.string());
+    }
+
+    try
+    {
+        WriteDurably(file, MakeHeader());
+        std::filesystem::rename(temp, path_);
+    }
+    catch(...)
+    {
+        std::fclose(file);
+        std::error_code error;
+        std::filesystem::remove(temp, error);
+        throw;
+    }
+
+    // Открытый файл переименован вместе с именем, и записи идут после
+    // заголовка
+    std::fclose(file_);
+    file_ = file;
+
+    std::filesystem::path directory = path_.parent_path();
+    SyncFile(directory.empty() ? std::filesystem::path(".") : directory);
+}
+
+void Journal::WriterLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::string batch;
+
+    while(true)
+    {
+        wake_.wait(lock, [this]
+        {
+            return stop_ || !pending_.empty();
+        });
+
+        if(pending_.empty())
+        {
+            return;
+        }
+
+        // Всё, что накопилось за время предыдущей записи, уходит одним fsync
+        batch.swap(pending_);
+        std::uint64_t target = appended_;
+        lock.unlock();
+
+        std::string error;
+
+        try
+        {
+            WriteDurably(file_, batch);
+        }
+        catch(const std::exception& e)
+        {
+            error = e.what();
+        }
+
+        batch.clear();
+        lock.lock();
+
+        if(!error.empty() && error_.empty())
+        {
+            error_ = error;
+        }
+
+        durable_ = target;
+        synced_.notify_all();
+    }
+}
+
+void SyncFile(const std::filesystem::path& path)
+{
+#ifdef JOURNAL_HAS_FSYNC
+    int fd = ::open(path.c_str(), O_RDONLY);
+
+    if(fd < 0 || ::fsync(fd) != 0)
+    {
+        if(fd >= 0)
+        {
+            ::close(fd);
+        }
+
+        throw std::runtime_error("Cannot sync " + path.string());
+    }
+
+    ::close(fd);
+#endif
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "common.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Операция, записанная в журнал: новый текст ячейки, формула или очистка
+// ячейки. Формула записана выражением шаблона text и сдвигом копии shift,
+// как в снимке: так её копии при чтении снова разделяют одно выражение.
+struct JournalRecord
+{
+    enum class Kind : std::uint8_t
+    {
+        Set,
+        Clear,
+        SetShifted,
+    };
+
+    Kind kind;
+    Position pos;
+    std::string text;
+    Position shift{0, 0};
+};
+
+// Журнал операций с ячейками (write-ahead log). Файл - заголовок и записи
+// подряд; запись - длина и контрольная сумма тела, затем тело: вид
+// операции, строка, столбец, у формулы - сдвиг по строкам и столбцам, и
+// текст.
+//
+// Append() только кодирует запись в буфер. Фоновый поток забирает всё
+// накопленное разом, дописывает в файл и сбрасывает на диск одним fsync
+// (групповая фиксация), так что под потоком правок число fsync не растёт
+// с числом записей. Sync() дожидается, пока на диске окажется всё, что
+// добавлено до вызова.
+//
+// Ошибка записи в файл запоминается. Append() её не бросает: правка уже
+// сделана в таблице, и журнал, который перестал писаться, отбрасывает
+// новые записи. Ошибку сообщает следующий Sync().
+class Journal
+{
+public:
+    // Открывает журнал, создавая его при необходимости. Записи, уже лежащие
+    // в файле, читаются и доступны через TakeRecords(). Недописанный при
+    // сбое хвост отрезается. Бросает std::runtime_error, если файл не
+    // открывается или это не журнал.
+    explicit Journal(const std::filesystem::path& path);
+    // Дописывает и сбрасывает на диск оставшиеся записи
+    ~Journal();
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    std::vector<JournalRecord> TakeRecords();
+
+    // shift записывается только для JournalRecord::Kind::SetShifted
+    void Append(JournalRecord::Kind kind, Position pos, std::string_view text, Position shift = {0, 0});
+    // Бросает std::runtime_error, если запись в файл не удалась
+    void Sync();
+    // Очищает журнал после того, как его записи сохранены в снимке:
+    // пустой журнал пишется во временный файл и подменяет прежний
+    // переименованием. Если подмена не удалась, остаётся прежний журнал, и
+    // записи дописываются в него.
+    void Reset();
+
+private:
+    void WriterLoop();
+
+    std::filesystem::path path_;
+    std::FILE* file_ = nullptr;
+    std::vector<JournalRecord> records_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable synced_;
+    // Записи, ещё не отданные фоновому потоку
+    std::string pending_;
+    // Байт добавлено и байт сброшено на диск за всё время
+    std::uint64_t appended_ = 0;
+    std::uint64_t durable_ = 0;
+    std::string error_;
+    bool stop_ = false;
+    std::thread writer_;
+};
+
+// Сбрасывает содержимое файла на диск. Для каталога - его записи, в том
+// числе сделанные переименования.
+void SyncFile(const std::filesystem::path& path);
@@ -1,9 +1,29 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstddef>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
 #include <limits>
+#include <new>
+#include <thread>
+#include <unordered_set>
 
+#include "FormulaAST.h"
 #include "common.h"
 #include "formula.h"
+#include "sheet.h"
+#include "snapshot.h"
 #include "test_runner_p.h"
 
+#if __has_include(<sys/resource.h>)
+#include <sys/resource.h>
+#endif
+
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
 }
@@ -25,6 +45,123 @@ inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value
     return output;
 }
 
+// Счётчики выделений памяти для тестов, которые проверяют их отсутствие и
+// возврат памяти: всего выделений и ещё не освобождённых блоков.
+// Заменяется весь набор глобальных operator new и delete, и все они
+// выделяют и освобождают память одной парой aligned_alloc/free.
+std::atomic<size_t> g_allocations{0};
+std::atomic<std::ptrdiff_t> g_live_blocks{0};
+
+namespace {
+
+void* CountedAllocate(std::size_t size, std::size_t alignment) noexcept {
+    ++g_allocations;
+    size = size == 0 ? 1 : size;
+    void* ptr = alignment <= alignof(std::max_align_t)
+                    ? std::malloc(size)
+                    : std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    if (ptr != nullptr) {
+        ++g_live_blocks;
+    }
+    return ptr;
+}
+
+void CountedFree(void* ptr) noexcept {
+    if (ptr != nullptr) {
+        --g_live_blocks;
+    }
+    std::free(ptr);
+}
+
+void* CountedAllocateOrThrow(std::size_t size, std::size_t alignment) {
+    if (void* ptr = CountedAllocate(size, alignment)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+    return CountedAllocateOrThrow(size, alignof(std::max_align_t));
+}
+
+void* operator new[](std::size_t size) {
+    return CountedAllocateOrThrow(size, alignof(std::max_align_t));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return CountedAllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return CountedAllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return CountedAllocate(size, alignof(std::max_align_t));
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return CountedAllocate(size, alignof(std::max_align_t));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return CountedAllocate(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return CountedAllocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* ptr) noexcept {
+    CountedFree(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    CountedFree(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    CountedFree(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    CountedFree(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    CountedFree(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    CountedFree(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+    CountedFree(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+    CountedFree(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    CountedFree(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    CountedFree(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    CountedFree(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    CountedFree(ptr);
+}
+
 namespace {
 
 void TestPositionAndStringConversion() {
@@ -192,6 +329,32 @@ void TestFormulaReferencedCells() {
     ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
 }
 
+void TestFormulaReadDoesNotReparse() {
+    // Ячейка хранит разобранную формулу: чтение значения, текста и ссылок,
+    // печать и пересчёт после правок не разбирают её заново
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+    sheet->SetCell("B1"_pos, "=A1*3+A2");
+    sheet->SetCell("C1"_pos, "=B1+SUM(A1:A2)");
+
+    const FormulaCacheStats before = GetFormulaCacheStats();
+    for (int i = 0; i < 100; ++i) {
+        sheet->SetCell("A2"_pos, std::to_string(i));
+        sheet->GetCell("C1"_pos)->GetValue();
+        sheet->GetCell("C1"_pos)->GetText();
+        sheet->GetCell("B1"_pos)->GetReferencedCells();
+        std::ostringstream values;
+        sheet->PrintValues(values);
+    }
+    const FormulaCacheStats after = GetFormulaCacheStats();
+    ASSERT_EQUAL(after.hits + after.misses, before.hits + before.misses);
+
+    // Повторные вычисления не дописывают ссылки к уже найденным
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(206.0));
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetText(), "=B1+SUM(A1:A2)");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos}));
+}
+
 void TestErrorValue() {
     auto sheet = CreateSheet();
     sheet->SetCell("E2"_pos, "A1");
@@ -348,6 +511,1370 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestDependentsRecalculated() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "=A1+1");
+    sheet->SetCell("A3"_pos, "=A2*2");
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), CellInterface::Value(4.0));
+
+    sheet->SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), CellInterface::Value(12.0));
+
+    sheet->SetCell("A1"_pos, "text");
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Value));
+
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    // Неудачная попытка создать цикл не должна оставлять лишних связей
+    try {
+        sheet->SetCell("A1"_pos, "=A3");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    sheet->SetCell("A2"_pos, "7");
+    sheet->SetCell("A1"_pos, "=A3");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(14.0));
+}
+
+void TestCircularReferencesDiamond() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=B1+C1");
+    sheet->SetCell("B1"_pos, "=D1");
+    sheet->SetCell("C1"_pos, "=D1");
+    // Ромб из зависимостей - не цикл
+    sheet->SetCell("D1"_pos, "=E1*2");
+
+    bool caught = false;
+    try {
+        sheet->SetCell("E1"_pos, "=E1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    caught = false;
+    try {
+        sheet->SetCell("E1"_pos, "=F1+A1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    // Неудачная запись не оставляет после себя пустую ячейку
+    ASSERT(sheet->GetCell("E1"_pos) == nullptr);
+
+    sheet->SetCell("E1"_pos, "3");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(12.0));
+}
+
+void TestRecalculationDiamondChain() {
+    auto sheet = CreateSheet();
+    const int levels = 40;
+    sheet->SetCell("B1"_pos, "1");
+    sheet->SetCell("C1"_pos, "1");
+    for (int i = 1; i < levels; ++i) {
+        std::string prev = std::to_string(i);
+        std::string row = std::to_string(i + 1);
+        sheet->SetCell(Position::FromString("A" + row), "=B" + prev + "+C" + prev);
+        sheet->SetCell(Position::FromString("B" + row), "=A" + row);
+        sheet->SetCell(Position::FromString("C" + row), "=A" + row);
+    }
+    Position last = Position::FromString("B" + std::to_string(levels));
+    ASSERT_EQUAL(sheet->GetCell(last)->GetValue(), CellInterface::Value(std::pow(2.0, levels - 1)));
+
+    sheet->SetCell("C1"_pos, "3");
+    ASSERT_EQUAL(sheet->GetCell(last)->GetValue(), CellInterface::Value(std::pow(2.0, levels)));
+
+    // Длинная цепочка не должна приводить к глубокой рекурсии
+    const int length = 2000;
+    for (int i = 1; i < length; ++i) {
+        sheet->SetCell(Position{i, 4}, "=" + Position{i - 1, 4}.ToString() + "+1");
+    }
+    sheet->SetCell(Position{0, 4}, "1");
+    ASSERT_EQUAL(sheet->GetCell(Position{length - 1, 4})->GetValue(),
+                    CellInterface::Value(double(length)));
+}
+
+void TestParallelRecalculation() {
+    Sheet sheet;
+    sheet.SetWorkerCount(4);
+    ASSERT_EQUAL(sheet.GetWorkerCount(), 4u);
+
+    const int rows = 500;
+    for (int row = 0; row < rows; ++row) {
+        std::string r = std::to_string(row + 1);
+        sheet.SetCell(Position{row, 0}, std::to_string(row));
+        sheet.SetCell(Position{row, 1}, "2");
+        sheet.SetCell(Position{row, 2}, "=A" + r + "*B" + r);
+        sheet.SetCell(Position{row, 3}, "=C" + r + "+A" + r);
+    }
+    for (int row = 0; row < rows; ++row) {
+        ASSERT_EQUAL(sheet.GetCell(Position{row, 3})->GetValue(), CellInterface::Value(3.0 * row));
+    }
+
+    sheet.SetWorkerCount(2);
+    for (int row = 0; row < rows; ++row) {
+        sheet.SetCell(Position{row, 1}, row % 2 == 0 ? "1" : "x");
+    }
+    for (int row = 0; row < rows; ++row) {
+        auto expected = row % 2 == 0 ? CellInterface::Value(2.0 * row)
+                                     : CellInterface::Value(FormulaError::Category::Value);
+        ASSERT_EQUAL(sheet.GetCell(Position{row, 3})->GetValue(), expected);
+    }
+
+    sheet.SetWorkerCount(1);
+    ASSERT_EQUAL(sheet.GetWorkerCount(), 1u);
+}
+
+void TestFormulaDeepExpression() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+
+    // Правоассоциативная запись требует глубокого стека вычислений
+    std::string expr = "A1";
+    for (int i = 0; i < 100; ++i) {
+        expr = "1-(" + expr + ")";
+    }
+    ASSERT_EQUAL(std::get<double>(ParseFormula(expr)->Evaluate(*sheet)), 2.0);
+
+    sheet->SetCell("B1"_pos, "=-(A1*3)/-A1+-(-A1)");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+    sheet->SetCell("A1"_pos, "0");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Arithmetic));
+}
+
+void TestFormulaParserEdgeCases() {
+    auto reformat = [](std::string expr) {
+        return ParseFormula(std::move(expr))->GetExpression();
+    };
+
+    ASSERT_EQUAL(reformat("1-2"), "1-2");
+    ASSERT_EQUAL(reformat(".5"), "0.5");
+    ASSERT_EQUAL(reformat("1E+2"), "100");
+    ASSERT_EQUAL(reformat("2.5e-1"), "0.25");
+    ASSERT_EQUAL(reformat("-1*2"), "-1*2");
+    ASSERT_EQUAL(reformat("-(1+2)"), "-(1+2)");
+    ASSERT_EQUAL(reformat("2*-3"), "2*-3");
+    ASSERT_EQUAL(reformat("1--2"), "1--2");
+    ASSERT_EQUAL(reformat("\tA1 /\n(B2-C3)\r"), "A1/(B2-C3)");
+    ASSERT_EQUAL(reformat("ZZ10*(1-2)/(3*4)"), "ZZ10*(1-2)/(3*4)");
+
+    auto isIncorrect = [](std::string expression) {
+        try {
+            ParseFormula(std::move(expression));
+        } catch (const FormulaException&) {
+            return true;
+        }
+        return false;
+    };
+
+    ASSERT(isIncorrect(""));
+    ASSERT(isIncorrect("1."));
+    ASSERT(isIncorrect("1e"));
+    ASSERT(isIncorrect("A"));
+    ASSERT(isIncorrect("a1"));
+    ASSERT(isIncorrect("()"));
+    ASSERT(isIncorrect("1 2"));
+    ASSERT(isIncorrect("*2"));
+    ASSERT(isIncorrect("(1+2))"));
+    ASSERT(isIncorrect("1e400"));
+}
+
+void TestErrorPropagation() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=1/0");
+    sheet->SetCell("B1"_pos, "=A1+1");
+    sheet->SetCell("C1"_pos, "=-B1*D1");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Arithmetic));
+
+    sheet->SetCell("D1"_pos, "-3.5");
+    sheet->SetCell("A1"_pos, "=2");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(10.5));
+
+    // Текст должен целиком представлять число
+    sheet->SetCell("D1"_pos, "1-2");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Value));
+}
+
+void TestPrintableSizeAfterClear() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("B2"_pos, "x");
+    sheet->SetCell("D3"_pos, "y");
+    sheet->SetCell("BM70"_pos, "z");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{70, 65}));
+    ASSERT_EQUAL(sheet->GetCell("BM70"_pos)->GetText(), "z");
+    ASSERT(sheet->GetCell("BM69"_pos) == nullptr);
+
+    sheet->ClearCell("BM70"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{3, 4}));
+    sheet->ClearCell("D3"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
+    sheet->ClearCell("B2"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+
+    sheet->SetCell("XFD16384"_pos, "=A1+1");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+    ASSERT_EQUAL(sheet->GetCell("XFD16384"_pos)->GetValue(), CellInterface::Value(1.0));
+    sheet->ClearCell("XFD16384"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+    ASSERT(sheet->GetCell("XFD16384"_pos) == nullptr);
+}
+
+void TestCompactCellContents() {
+    auto sheet = CreateSheet();
+    // Текст, совпадающий с записью числа, и текст, который лишь похож на неё
+    sheet->SetCell("A1"_pos, "42");
+    sheet->SetCell("A2"_pos, "1.50");
+    sheet->SetCell("A3"_pos, "-0.25");
+    sheet->SetCell("A4"_pos, "1e3");
+    sheet->SetCell("A5"_pos, "");
+    sheet->SetCell("B1"_pos, "same");
+    sheet->SetCell("B2"_pos, "same");
+    sheet->SetCell("C1"_pos, "=A1+A2+A3+A5");
+
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "42");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value("42"));
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetText(), "1.50");
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetText(), "-0.25");
+    ASSERT_EQUAL(sheet->GetCell("A4"_pos)->GetText(), "1e3");
+    ASSERT(sheet->GetCell("A5"_pos) != nullptr);
+    ASSERT_EQUAL(sheet->GetCell("A5"_pos)->GetText(), "");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(43.25));
+
+    // Объект ячейки переживает смену содержимого
+    CellInterface* cell = sheet->GetCell("B1"_pos);
+    ASSERT(cell == sheet->GetCell("B1"_pos));
+    sheet->SetCell("B1"_pos, "=A1*2");
+    ASSERT_EQUAL(cell->GetValue(), CellInterface::Value(84.0));
+    ASSERT_EQUAL(cell->GetReferencedCells(), std::vector{"A1"_pos});
+    sheet->SetCell("B1"_pos, "other");
+    ASSERT_EQUAL(cell->GetText(), "other");
+    ASSERT(cell->GetReferencedCells().empty());
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetText(), "same");
+
+    sheet->ClearCell("B2"_pos);
+    sheet->SetCell("B3"_pos, "same");
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetText(), "same");
+    ASSERT(sheet->GetCell("B2"_pos) == nullptr);
+}
+
+void TestNumericTextInFormulas() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1.50");
+    sheet->SetCell("A2"_pos, "007");
+    sheet->SetCell("A3"_pos, "'2");
+    sheet->SetCell("A4"_pos, "'");
+    sheet->SetCell("B1"_pos, "=A1+A2+A3+A4");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.5));
+
+    const FormulaError value_error(FormulaError::Category::Value);
+    for (std::string text : {"1e3", "12abc", "-", ".", "1-2", "=", " 1"}) {
+        sheet->SetCell("A4"_pos, text);
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(value_error));
+    }
+
+    // Один и тот же текст в разных ячейках разбирается один раз и остаётся
+    // числом после очистки одной из них
+    sheet->SetCell("A4"_pos, "1.50");
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.5));
+    ASSERT_EQUAL(sheet->GetCell("A4"_pos)->GetValue(), CellInterface::Value("1.50"));
+}
+
+void TestCellMemoryReclaimed() {
+    // Перезапись и очистка возвращают память ячеек, формул и текстов, и
+    // следующие правки берут её снова: живых блоков после каждого круга
+    // правок не больше, чем после первых
+    auto sheet = CreateSheet();
+    const int rows = 300;
+    auto edit_round = [&](int round) {
+        for (int row = 0; row < rows; ++row) {
+            std::string next = std::to_string(row + 2);
+            sheet->SetCell({row, 0}, "=B" + next + "*2+SUM(B1:B" + next + ")");
+            sheet->SetCell({row, 1}, std::to_string(round * rows + row));
+            sheet->SetCell({row, 2}, "=A" + next + "+B" + next);
+            sheet->GetCell({row, 2})->GetValue();
+            sheet->SetCell({row, 0}, "overwritten text " + std::to_string(round) + " " + next);
+            sheet->SetCell({row, 1}, "=D" + next + "/2");
+            sheet->GetCell({row, 0})->GetText();
+        }
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < 3; ++col) {
+                sheet->ClearCell({row, col});
+            }
+        }
+    };
+
+    edit_round(0);
+    edit_round(1);
+    const std::ptrdiff_t baseline = g_live_blocks;
+    std::ptrdiff_t most = baseline;
+    for (int round = 2; round < 20; ++round) {
+        edit_round(round);
+        most = std::max<std::ptrdiff_t>(most, g_live_blocks);
+    }
+    ASSERT_EQUAL(most, baseline);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+    ASSERT(sheet->GetCell({0, 0}) == nullptr);
+}
+
+void TestFormulaParseAllocations() {
+    // Узлы, ссылки и программа формулы лежат в её арене: разбор выделяет
+    // память только под арену и её блоки, которые растут геометрически, а
+    // не под каждую ссылку
+    const int references = 100;
+    std::string expression = "SUM(A1:B2)";
+    for (int row = 1; row <= references; ++row) {
+        expression += "+C" + std::to_string(row);
+    }
+    const size_t before = g_allocations;
+    FormulaAST ast = ParseFormulaAST(expression);
+    const size_t allocations = g_allocations - before;
+    ASSERT(allocations < 16u);
+    ASSERT_EQUAL(std::distance(ast.GetCells().begin(), ast.GetCells().end()), references);
+}
+
+void TestFormulaEvaluateDoesNotAllocate() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+    sheet->SetCell("B2"_pos, "1.50");
+    sheet->SetCell("C3"_pos, "=A1*10");
+    sheet->SetCell("D4"_pos, "'text");
+
+    auto formula = ParseFormula("A1+B2*C3-A1/(C3+1)+A1+B2+C3+A1*A1");
+    auto wide = ParseFormula("A1+B1+C1+D1+E1+F1+G1+A1");
+    auto invalid = ParseFormula("A1+D4");
+    ASSERT_EQUAL(formula->GetReferencedCells(), (std::vector{"A1"_pos, "B2"_pos, "C3"_pos}));
+    ASSERT_EQUAL(wide->GetReferencedCells().size(), 7u);
+
+    // Первое обращение пересчитывает C3
+    const FormulaInterface::Value expected = formula->Evaluate(*sheet);
+    ASSERT(std::holds_alternative<double>(expected));
+
+    // Сами ASSERT выделяют память, поэтому проверки - после цикла
+    bool all_equal = true;
+    const size_t before = g_allocations;
+    for (int i = 0; i < 1000; ++i) {
+        all_equal = all_equal && formula->Evaluate(*sheet) == expected;
+        all_equal = all_equal && std::holds_alternative<double>(wide->Evaluate(*sheet));
+        all_equal = all_equal && std::holds_alternative<FormulaError>(invalid->Evaluate(*sheet));
+    }
+    const size_t allocations = g_allocations - before;
+    ASSERT_EQUAL(allocations, 0u);
+    ASSERT(all_equal);
+
+    // Повторные вычисления не накапливают ссылки
+    ASSERT_EQUAL(formula->GetReferencedCells().size(), 3u);
+}
+
+void TestRangeAggregates() {
+    auto sheet = CreateSheet();
+    for (int i = 1; i <= 10; ++i) {
+        sheet->SetCell(Position{i - 1, 0}, std::to_string(i));
+    }
+    sheet->SetCell("A11"_pos, "text");
+    sheet->SetCell("A12"_pos, "1.50");
+    sheet->SetCell("A13"_pos, "=A1*100");
+    sheet->SetCell("A14"_pos, "");
+
+    auto value = [&](Position pos) {
+        return sheet->GetCell(pos)->GetValue();
+    };
+
+    sheet->SetCell("B1"_pos, "=SUM(A1:A15)");
+    sheet->SetCell("B2"_pos, "=AVERAGE(A1:A10)");
+    sheet->SetCell("B3"_pos, "=MIN(A15:A1)");
+    sheet->SetCell("B4"_pos, "=MAX(A1:A15)");
+    sheet->SetCell("B5"_pos, "=COUNT(A1:A15)");
+    sheet->SetCell("B6"_pos, "=SUM(A11)+COUNT(A11,A12)");
+    sheet->SetCell("B7"_pos, "=MAX(SUM(A1:A2),A3*2,-1)/2");
+    ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(156.5));
+    ASSERT_EQUAL(value("B2"_pos), CellInterface::Value(5.5));
+    ASSERT_EQUAL(value("B3"_pos), CellInterface::Value(1.0));
+    ASSERT_EQUAL(value("B4"_pos), CellInterface::Value(100.0));
+    ASSERT_EQUAL(value("B5"_pos), CellInterface::Value(12.0));
+    ASSERT_EQUAL(value("B6"_pos), CellInterface::Value(1.0));
+    ASSERT_EQUAL(value("B7"_pos), CellInterface::Value(3.0));
+
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetText(), "=MIN(A1:A15)");
+    ASSERT_EQUAL(sheet->GetCell("B7"_pos)->GetText(), "=MAX(SUM(A1:A2),A3*2,-1)/2");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells().size(), 10u);
+
+    // Изменения внутри диапазона доходят до агрегатов
+    sheet->SetCell("A1"_pos, "11");
+    ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(1166.5));
+    sheet->SetCell("A5"_pos, "=1/0");
+    ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(FormulaError::Category::Arithmetic));
+    sheet->ClearCell("A5"_pos);
+    ASSERT_EQUAL(value("B5"_pos), CellInterface::Value(11.0));
+
+    sheet->SetCell("C1"_pos, "=AVERAGE(D1:D5)+MIN(D1:D5)");
+    ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(FormulaError::Category::Arithmetic));
+    sheet->SetCell("C2"_pos, "=MIN(D1:D5)+MAX(D1:D5)+COUNT(D1:D5)");
+    ASSERT_EQUAL(value("C2"_pos), CellInterface::Value(0.0));
+
+    try {
+        sheet->SetCell("D3"_pos, "=SUM(C1:C3)");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    for (std::string formula : {"=SUM()", "=FOO(A1)", "=A1:A2", "=SUM(A1:)", "=SUM(A1:B)",
+                                "=SUM(A1:A2+1)", "=SUM A1", "=SUM(A1,)", "=SUM(A1:ZZZZ1)"}) {
+        try {
+            sheet->SetCell("E1"_pos, formula);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+}
+
+void TestRangeAggregatesAcrossTiles() {
+    // Диапазоны, пересекающие плитки, целые строки плиток и одиночные
+    // столбцы - по разным путям обхода
+    Sheet sheet;
+    for (int row = 50; row < 200; ++row) {
+        for (int col = 0; col < 140; col += (row % 3) + 1) {
+            double number = (row * 7 + col) % 23 - 11;
+            sheet.SetCell({row, col}, (row + col) % 17 == 0 ? "=" + std::to_string(number)
+                                                             : std::to_string(static_cast<int>(number)));
+        }
+    }
+
+    auto naive = [&](Range range, bool count) {
+        double result = 0;
+        for (int row = range.first.row; row <= range.last.row; ++row) {
+            for (int col = range.first.col; col <= range.last.col; ++col) {
+                if (sheet.GetCell({row, col}) != nullptr) {
+                    result += count ? 1 : std::get<double>(sheet.GetNumericValue({row, col}));
+                }
+            }
+        }
+        return result;
+    };
+
+    const Range ranges[] = {
+        {{0, 0}, {299, 139}}, {{60, 64}, {140, 127}}, {{55, 63}, {199, 63}},
+        {{64, 1}, {70, 130}}, {{127, 70}, {129, 70}}, {{0, 0}, {0, 0}},
+    };
+    for (Range range : ranges) {
+        sheet.SetCell({400, 0}, "=SUM(" + range.ToString() + ")");
+        sheet.SetCell({400, 1}, "=COUNT(" + range.ToString() + ")");
+        ASSERT_EQUAL(sheet.GetCell({400, 0})->GetValue(), CellInterface::Value(naive(range, false)));
+        ASSERT_EQUAL(sheet.GetCell({400, 1})->GetValue(), CellInterface::Value(naive(range, true)));
+    }
+}
+
+void TestRangeDependencies() {
+    // Тысяча формул над целыми столбцами: при раскрытии диапазонов это
+    // были бы десятки миллионов рёбер графа
+    auto sheet = CreateSheet();
+    const int formulas = 1000;
+    for (int i = 0; i < formulas; ++i) {
+        sheet->SetCell(Position{i, 3}, "=SUM(A1:A16384)+COUNT(B1:C16384)*" + std::to_string(i));
+    }
+    sheet->SetCell("A100"_pos, "5");
+    sheet->SetCell("C16384"_pos, "=A100*2");
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(5.0));
+    ASSERT_EQUAL(sheet->GetCell("D11"_pos)->GetValue(), CellInterface::Value(15.0));
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetReferencedCells().size(), 3u * 16384u);
+
+    // Ссылка через диапазон замыкает цикл
+    for (std::string formula : {"=SUM(A1:A16384)", "=D5", "=MAX(D1:D2)"}) {
+        try {
+            sheet->SetCell("A7"_pos, formula);
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+    }
+    try {
+        sheet->SetCell("B2"_pos, "=SUM(D999:E1000)");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(sheet->GetCell("A7"_pos) == nullptr);
+    ASSERT(sheet->GetCell("B2"_pos) == nullptr);
+
+    // Правки внутри диапазонов доходят до зависящих формул
+    sheet->SetCell("A100"_pos, "1");
+    ASSERT_EQUAL(sheet->GetCell("D3"_pos)->GetValue(), CellInterface::Value(3.0));
+    sheet->ClearCell("C16384"_pos);
+    ASSERT_EQUAL(sheet->GetCell("D3"_pos)->GetValue(), CellInterface::Value(1.0));
+
+    // После замены формулы её старые диапазоны больше ни на что не влияют
+    sheet->SetCell("D1"_pos, "=SUM(E1:E2)");
+    sheet->SetCell("A100"_pos, "=D1+7");
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT_EQUAL(sheet->GetCell("D2"_pos)->GetValue(), CellInterface::Value(7.0));
+    sheet->ClearCell("D1"_pos);
+    ASSERT_EQUAL(sheet->GetCell("D2"_pos)->GetValue(), CellInterface::Value(7.0));
+
+    // Одинаковые диапазоны одной формулы снимаются по одному
+    sheet->SetCell("F1"_pos, "=SUM(A1:A200)+SUM(A1:A200)");
+    sheet->SetCell("F2"_pos, "=SUM(A1:A200)");
+    sheet->SetCell("F1"_pos, "=SUM(A1:A200)");
+    sheet->SetCell("A150"_pos, "4");
+    ASSERT_EQUAL(sheet->GetCell("F1"_pos)->GetValue(), CellInterface::Value(11.0));
+    sheet->ClearCell("F1"_pos);
+    sheet->SetCell("A150"_pos, "5");
+    ASSERT_EQUAL(sheet->GetCell("F2"_pos)->GetValue(), CellInterface::Value(12.0));
+
+    // Удаление множества формул над одним блоком не перебирает списки
+    // узлов, иначе оно квадратично по числу формул
+    const int overlapping = 16000;
+    for (int row = 0; row < overlapping; ++row) {
+        sheet->SetCell({row, 6}, "=SUM(A1:A200)");
+    }
+    for (int row = 0; row < overlapping; ++row) {
+        sheet->ClearCell({row, 6});
+    }
+    sheet->SetCell("A150"_pos, "6");
+    ASSERT_EQUAL(sheet->GetCell("F2"_pos)->GetValue(), CellInterface::Value(13.0));
+}
+
+void TestColumnAggregates() {
+    // Нарастающий итог: каждая строка суммирует столбец от начала
+    const int rows = 3000;
+    Sheet plain;
+    Sheet indexed;
+    indexed.SetColumnAggregates(true);
+    ASSERT(indexed.HasColumnAggregates() && !plain.HasColumnAggregates());
+
+    for (Sheet* sheet : {&plain, &indexed}) {
+        for (int row = 0; row < rows; ++row) {
+            std::string row_str = std::to_string(row + 1);
+            sheet->SetCell({row, 0}, std::to_string(row % 7 - 3));
+            sheet->SetCell({row, 1}, "=SUM(A1:A" + row_str + ")");
+            sheet->SetCell({row, 2}, "=MIN(A1:A" + row_str + ")+MAX(A1:A" + row_str + ")*COUNT(A1:A"
+                                         + row_str + ")");
+        }
+        sheet->SetCell({5, 0}, "text");
+        sheet->SetCell({6, 0}, "1.50");
+        sheet->SetCell({7, 0}, "=A1*10");
+    }
+
+    auto check_same = [&](std::initializer_list<int> rows_to_check) {
+        for (int row : rows_to_check) {
+            for (int col = 1; col < 3; ++col) {
+                ASSERT_EQUAL(indexed.GetCell({row, col})->GetValue(),
+                             plain.GetCell({row, col})->GetValue());
+            }
+        }
+    };
+    check_same({0, 5, 6, 7, 100, rows - 1});
+
+    // Правки в начале столбца, ошибки и очистка
+    for (Sheet* sheet : {&plain, &indexed}) {
+        sheet->SetCell({0, 0}, "100");
+    }
+    check_same({0, 7, 1000, rows - 1});
+    ASSERT_EQUAL(indexed.GetCell({rows - 1, 1})->GetValue(),
+                 plain.GetCell({rows - 1, 1})->GetValue());
+
+    for (Sheet* sheet : {&plain, &indexed}) {
+        sheet->SetCell({10, 0}, "=1/0");
+    }
+    check_same({9, 10, rows - 1});
+    ASSERT_EQUAL(indexed.GetCell({rows - 1, 1})->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
+
+    for (Sheet* sheet : {&plain, &indexed}) {
+        sheet->ClearCell({10, 0});
+        sheet->ClearCell({0, 0});
+    }
+    check_same({0, 10, 2999});
+
+    // Включение на заполненной таблице строит деревья по имеющимся ячейкам
+    plain.SetColumnAggregates(true);
+    plain.SetCell({3000, 3}, "=SUM(A1:C3000)+AVERAGE(A1:A3000)");
+    indexed.SetColumnAggregates(false);
+    indexed.SetCell({3000, 3}, "=SUM(A1:C3000)+AVERAGE(A1:A3000)");
+    ASSERT_EQUAL(indexed.GetCell({3000, 3})->GetValue(), plain.GetCell({3000, 3})->GetValue());
+
+    // Диапазон ниже занятых строк и запись далеко за ними, от которой
+    // дерево столбца достраивается
+    for (Sheet* sheet : {&plain, &indexed}) {
+        sheet->SetCell({0, 5}, "=SUM(A2990:A16000)+COUNT(E1:E16000)");
+    }
+    ASSERT_EQUAL(indexed.GetCell({0, 5})->GetValue(), plain.GetCell({0, 5})->GetValue());
+    double before = std::get<double>(plain.GetCell({0, 5})->GetValue());
+
+    for (Sheet* sheet : {&plain, &indexed}) {
+        sheet->SetCell({15999, 0}, "1000");
+        sheet->SetCell({12000, 4}, "1");
+    }
+    ASSERT_EQUAL(indexed.GetCell({0, 5})->GetValue(), plain.GetCell({0, 5})->GetValue());
+    ASSERT_EQUAL(std::get<double>(plain.GetCell({0, 5})->GetValue()), before + 1001);
+}
+
+void TestFillFormulas() {
+    Sheet sheet;
+    const int rows = 1000;
+    for (int row = 0; row < rows; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row));
+        sheet.SetCell({row, 1}, "2");
+    }
+    sheet.SetCell("C1"_pos, "=A1*B1");
+    sheet.FillDown("C1"_pos, rows - 1);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{rows, 3}));
+    ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetText(), "=A500*B500");
+    ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetValue(), CellInterface::Value(998.0));
+    ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetReferencedCells(),
+                 (std::vector{"A500"_pos, "B500"_pos}));
+
+    // Копии - полноценные формулы: зависимости и пересчёт
+    sheet.SetCell("B500"_pos, "3");
+    ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetValue(), CellInterface::Value(1497.0));
+    sheet.SetCell("D1"_pos, "=SUM(C1:C1000)");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(rows * (rows - 1) + 499.0));
+
+    // Диапазоны сдвигаются по строкам и столбцам, ссылки за край - #REF!
+    sheet.SetCell("E2"_pos, "=SUM(A1:A3)+A1");
+    sheet.FillRange("E2"_pos, {"E1"_pos, "F3"_pos});
+    ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetText(), "=SUM(B2:B4)+B2");
+    ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetValue(), CellInterface::Value(8.0));
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=SUM(#REF!)+#REF!");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT(sheet.GetCell("E1"_pos)->GetReferencedCells().empty());
+
+    // Цикл в любой копии откатывает всё заполнение
+    sheet.SetCell("U1"_pos, "old");
+    sheet.SetCell("V1"_pos, "=V2");
+    sheet.SetCell("V3"_pos, "=V2");
+    try {
+        sheet.FillRange("V1"_pos, {"U1"_pos, "V2"_pos});
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("U1"_pos)->GetText(), "old");
+    ASSERT(sheet.GetCell("U2"_pos) == nullptr);
+    ASSERT(sheet.GetCell("V2"_pos) == nullptr);
+
+    // Значения копируются как есть, пустая ячейка очищает диапазон
+    sheet.SetCell("G1"_pos, "'7");
+    sheet.FillDown("G1"_pos, 3);
+    ASSERT_EQUAL(sheet.GetCell("G4"_pos)->GetText(), "'7");
+    sheet.FillRange("H1"_pos, {"G2"_pos, "G4"_pos});
+    ASSERT(sheet.GetCell("G4"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("G1"_pos)->GetText(), "'7");
+}
+
+void TestColumnBatchEvaluation() {
+    // Одни и те же формулы: протянутые (вычисляются пачками) и заданные
+    // текстом по одной
+    const int rows = 300;
+    Sheet filled;
+    Sheet separate;
+    filled.SetWorkerCount(4);
+    for (Sheet* sheet : {&filled, &separate}) {
+        for (int row = 0; row < rows; ++row) {
+            sheet->SetCell({row, 0}, std::to_string(row % 11 - 5));
+            sheet->SetCell({row, 1}, row < 200 ? std::to_string(row % 4 + 1) : "=A1+1");
+        }
+        sheet->SetCell("A10"_pos, "x");
+        sheet->SetCell("B20"_pos, "0");
+        sheet->SetCell("A30"_pos, "'12");
+        sheet->SetCell("A40"_pos, "=1/0");
+        sheet->ClearCell("A50"_pos);
+        sheet->SetCell("Y16384"_pos, "1");
+    }
+    const std::string formulas[] = {"=A1*B1-A1/B1+2", "=-(A1+B1)*3", "=SUM(A1:B1)", "=7"};
+    for (int f = 0; f < 4; ++f) {
+        filled.SetCell({0, 2 + f}, formulas[f]);
+        filled.FillDown({0, 2 + f}, rows - 1);
+        for (int row = 0; row < rows; ++row) {
+            separate.SetCell({row, 2 + f}, filled.GetCellText({row, 2 + f}));
+        }
+    }
+    // Последние копии ссылаются за край таблицы
+    filled.SetCell("X16380"_pos, "=Y16381*2");
+    filled.FillDown("X16380"_pos, 16383);
+    separate.SetCell("X16380"_pos, "=Y16381*2");
+    separate.SetCell("X16381"_pos, "=Y16382*2");
+    separate.SetCell("X16382"_pos, "=Y16383*2");
+    separate.SetCell("X16383"_pos, "=Y16384*2");
+
+    auto check_same = [&]() {
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 2; col < 6; ++col) {
+                ASSERT_EQUAL(filled.GetCell({row, col})->GetValue(),
+                             separate.GetCell({row, col})->GetValue());
+            }
+        }
+        for (int row = 16379; row < 16383; ++row) {
+            ASSERT_EQUAL(filled.GetCell({row, 23})->GetValue(),
+                         separate.GetCell({row, 23})->GetValue());
+        }
+    };
+    check_same();
+    ASSERT_EQUAL(filled.GetCell("C10"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(filled.GetCell("C20"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(filled.GetCell("X16384"_pos)->GetText(), "=#REF!*2");
+    ASSERT_EQUAL(filled.GetCell("X16384"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+
+    for (Sheet* sheet : {&filled, &separate}) {
+        sheet->SetCell("A1"_pos, "4");
+        sheet->SetCell("A10"_pos, "2");
+        sheet->SetCell("B20"_pos, "8");
+    }
+    check_same();
+
+    // Пачка копий даёт то же, что вычисление каждой копии по отдельности
+    auto formula = ParseFormula("A1/B1+A2");
+    auto shifted = formula->Shift(1, 0);
+    ASSERT(shifted->IsShiftOf(*formula, 1, 0));
+    ASSERT(!shifted->IsShiftOf(*formula, 0, 1));
+    ASSERT(!ParseFormula("A2/B2+A3")->IsShiftOf(*formula, 1, 0));
+    std::vector<FormulaInterface::Value> results(rows);
+    formula->EvaluateColumn(separate, rows, results.data());
+    for (int row = 0; row < rows; ++row) {
+        ASSERT(results[row] == formula->Shift(row, 0)->Evaluate(separate));
+    }
+}
+
+void TestConstantFolding() {
+    auto program_size = [](const std::string& expr) {
+        return ParseFormulaAST(expr).GetProgram().size();
+    };
+    ASSERT_EQUAL(program_size("2*3+A1*1"), 3u);
+    ASSERT_EQUAL(program_size("SUM(1,2,3)*(4-1)"), 1u);
+    ASSERT_EQUAL(program_size("--A1"), 1u);
+    ASSERT_EQUAL(program_size("+A1/1-0"), 1u);
+    ASSERT_EQUAL(program_size("1*-(-(A1))"), 1u);
+    // x+0 превращает -0 в 0, x-(-0) - тоже
+    ASSERT_EQUAL(program_size("A1+0"), 3u);
+    ASSERT_EQUAL(program_size("A1-(-0)"), 3u);
+    // Бесконечность не сворачивается: ошибка остаётся при вычислении
+    ASSERT_EQUAL(program_size("1/0"), 3u);
+
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "4");
+    sheet->SetCell("B1"_pos, "=2*3+A1*1");
+    sheet->SetCell("B2"_pos, "=+(--A1)/1-0");
+    sheet->SetCell("B3"_pos, "=1/0+A2");
+    sheet->SetCell("B4"_pos, "=1E+308*10-A1");
+    sheet->SetCell("B5"_pos, "=SUM(A3*1)");
+    sheet->SetCell("B6"_pos, "=SUM(A3)+MAX(1,2)");
+    sheet->SetCell("B7"_pos, "=-A4*1");
+    sheet->SetCell("A3"_pos, "text");
+    sheet->SetCell("A4"_pos, "0");
+
+    // Печатается формула в том виде, в котором её задали
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "=2*3+A1*1");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetText(), "=+--A1/1-0");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(4.0));
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(sheet->GetCell("B4"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
+    // Выражение над ячейкой не становится голой ячейкой агрегата
+    ASSERT_EQUAL(sheet->GetCell("B5"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet->GetCell("B6"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT(std::signbit(std::get<double>(sheet->GetCell("B7"_pos)->GetValue())));
+}
+
+void TestFormulaParseCache() {
+    FormulaCacheStats before = GetFormulaCacheStats();
+    ASSERT_EQUAL(before.capacity, DEFAULT_FORMULA_CACHE_CAPACITY);
+    auto first = ParseFormula("A1+B1*1000003");
+    auto second = ParseFormula(" A1+B1*1000003\t");
+    FormulaCacheStats after = GetFormulaCacheStats();
+    ASSERT_EQUAL(after.misses - before.misses, 1u);
+    ASSERT_EQUAL(after.hits - before.hits, 1u);
+    // Формулы разделяют одно разобранное выражение
+    ASSERT(second->IsShiftOf(*first, 0, 0));
+
+    // Одна и та же формула в разных таблицах вычисляется по своей таблице
+    Sheet left;
+    Sheet right;
+    left.SetCell("A1"_pos, "1");
+    right.SetCell("A1"_pos, "2");
+    left.SetCell("C1"_pos, "=A1+B1*1000003");
+    right.SetCell("C1"_pos, "=A1+B1*1000003");
+    ASSERT_EQUAL(GetFormulaCacheStats().hits - before.hits, 3u);
+    ASSERT_EQUAL(left.GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0));
+    ASSERT_EQUAL(right.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    // Ошибочные выражения не кэшируются
+    for (int i = 0; i < 2; ++i) {
+        try {
+            ParseFormula("A1+*1000003");
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+    ASSERT_EQUAL(GetFormulaCacheStats().misses - before.misses, 3u);
+
+    // Вытесняются давно не использованные выражения
+    SetFormulaCacheCapacity(2);
+    ASSERT_EQUAL(GetFormulaCacheStats().size, 2u);
+    auto one = ParseFormula("1000003+1");
+    ParseFormula("1000003+2");
+    ParseFormula("1000003+1");
+    ParseFormula("1000003+3");
+    ASSERT(ParseFormula("1000003+1")->IsShiftOf(*one, 0, 0));
+    FormulaCacheStats bounded = GetFormulaCacheStats();
+    ParseFormula("1000003+2");
+    ASSERT_EQUAL(GetFormulaCacheStats().misses - bounded.misses, 1u);
+    ASSERT_EQUAL(GetFormulaCacheStats().size, 2u);
+
+    SetFormulaCacheCapacity(0);
+    ASSERT_EQUAL(GetFormulaCacheStats().size, 0u);
+    ASSERT(!ParseFormula("1000003+1")->IsShiftOf(*one, 0, 0));
+    SetFormulaCacheCapacity(DEFAULT_FORMULA_CACHE_CAPACITY);
+
+    // Кэшем пользуются несколько потоков сразу
+    std::vector<std::thread> threads;
+    std::atomic<int> wrong{0};
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&wrong] {
+            for (int i = 0; i < 200; ++i) {
+                auto formula = ParseFormula(std::to_string(i % 50) + "*2");
+                Sheet empty;
+                if (std::get<double>(formula->Evaluate(empty)) != (i % 50) * 2) {
+                    ++wrong;
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    ASSERT_EQUAL(wrong.load(), 0);
+}
+
+void TestLoadDelimited() {
+    // Загрузка напечатанных текстов даёт ту же таблицу
+    Sheet source;
+    const int rows = 3000;
+    for (int row = 0; row < rows; ++row) {
+        if (row % 10 == 9) {
+            continue;
+        }
+        std::string next = std::to_string(row + 2);
+        source.SetCell({row, 0}, std::to_string(row * 0.25));
+        source.SetCell({row, 1}, row % 3 == 0 ? "'=text" : "1.50");
+        source.SetCell({row, 2}, row + 1 < rows ? "=A" + next + "*2+SUM(A1:B" + next + ")" : "=1/0");
+        source.SetCell({row, 4}, "=C" + std::to_string(row + 1) + "-1");
+    }
+    std::ostringstream texts;
+    source.PrintTexts(texts);
+
+    Sheet loaded;
+    loaded.SetWorkerCount(4);
+    std::istringstream input(texts.str());
+    loaded.LoadDelimited(input);
+    std::ostringstream loaded_texts;
+    loaded.PrintTexts(loaded_texts);
+    ASSERT_EQUAL(loaded_texts.str(), texts.str());
+    std::ostringstream values;
+    std::ostringstream loaded_values;
+    source.PrintValues(values);
+    loaded.PrintValues(loaded_values);
+    ASSERT_EQUAL(loaded_values.str(), values.str());
+    ASSERT(loaded.GetCell({9, 0}) == nullptr);
+
+    // После загрузки таблица работает как обычно
+    for (Sheet* sheet : {&source, &loaded}) {
+        sheet->SetCell("A3000"_pos, "100");
+    }
+    ASSERT_EQUAL(loaded.GetCell("C2999"_pos)->GetValue(), source.GetCell("C2999"_pos)->GetValue());
+    ASSERT_EQUAL(loaded.GetCell("E1"_pos)->GetValue(), source.GetCell("E1"_pos)->GetValue());
+
+    // CSV с переводами строк Windows
+    Sheet csv;
+    std::istringstream csv_input("1,2,=A1+B1\r\n,x\r\n");
+    csv.LoadDelimited(csv_input, ',');
+    ASSERT_EQUAL(csv.GetPrintableSize(), (Size{2, 3}));
+    ASSERT_EQUAL(csv.GetCell("C1"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT_EQUAL(csv.GetCell("B2"_pos)->GetText(), "x");
+    ASSERT(csv.GetCell("A2"_pos) == nullptr);
+
+    // Ошибка в любой ячейке оставляет таблицу прежней
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "keep");
+    sheet.SetCell("C1"_pos, "=A1");
+    auto expect_unchanged = [&]() {
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "keep");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 3}));
+    };
+    for (std::string text : std::vector<std::string>{"=C1\t5", "1\t=B1", "1\t=1+",
+                                                     std::string(16384, '\n') + "x"}) {
+        std::istringstream bad(text);
+        try {
+            sheet.LoadDelimited(bad);
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        } catch (const FormulaException&) {
+        } catch (const InvalidPositionException&) {
+        }
+        expect_unchanged();
+    }
+
+    // Загруженная формула ссылается только назад, но замыкает цикл через
+    // прежнюю
+    Sheet forward;
+    forward.SetCell("A1"_pos, "=B1");
+    std::istringstream closing("\t=A1");
+    try {
+        forward.LoadDelimited(closing);
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(forward.GetCell("B1"_pos) == nullptr);
+
+    // Загрузка из файла
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "spreadsheet_load_test.tsv";
+    {
+        std::ofstream file(path);
+        file << "\t=A2*2\n21";
+    }
+    Sheet from_file;
+    from_file.LoadDelimited(path);
+    std::filesystem::remove(path);
+    ASSERT_EQUAL(from_file.GetCell("B1"_pos)->GetValue(), CellInterface::Value(42.0));
+}
+
+void TestRefErrorRoundTrip() {
+    // Копия со ссылками за краем печатается с #REF! и читается обратно
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("E2"_pos, "=SUM(A1:A3)+A1");
+    sheet.FillRange("E2"_pos, {"E1"_pos, "E1"_pos});
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=SUM(#REF!)+#REF!");
+
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    Sheet loaded;
+    std::istringstream input(texts.str());
+    loaded.LoadDelimited(input);
+    std::ostringstream loaded_texts;
+    loaded.PrintTexts(loaded_texts);
+    ASSERT_EQUAL(loaded_texts.str(), texts.str());
+    ASSERT_EQUAL(loaded.GetCell("E1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT(loaded.GetCell("E1"_pos)->GetReferencedCells().empty());
+
+    // Показанный текст можно ввести заново
+    sheet.SetCell("G1"_pos, sheet.GetCell("E1"_pos)->GetText());
+    ASSERT_EQUAL(sheet.GetCell("G1"_pos)->GetText(), "=SUM(#REF!)+#REF!");
+    ASSERT_EQUAL(sheet.GetCell("G1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+
+    // #REF! не сдвигается при заполнении и не становится ссылкой
+    sheet.SetCell("H5"_pos, "=-#REF!*2+H1");
+    sheet.FillRange("H5"_pos, {"H6"_pos, "I6"_pos});
+    ASSERT_EQUAL(sheet.GetCell("I6"_pos)->GetText(), "=-#REF!*2+I2");
+    ASSERT_EQUAL(sheet.GetCell("I6"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(sheet.GetCell("I6"_pos)->GetReferencedCells(), (std::vector{"I2"_pos}));
+
+    for (std::string text : {"=#REF", "=#VALUE!", "=#REF!:A1", "=SUM(#REF!:A1)"}) {
+        try {
+            sheet.SetCell("J1"_pos, text);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+}
+
+void TestSnapshot() {
+    Sheet source;
+    const int rows = 2000;
+    source.SetCell("A1"_pos, "1");
+    source.SetCell("A2"_pos, "=A1*2");
+    source.FillDown("A2"_pos, rows - 1);
+    for (int row = 0; row < rows; ++row) {
+        source.SetCell({row, 1}, row % 2 == 0 ? "'=text" : "1.50");
+    }
+    source.SetCell("C1"_pos, "=SUM(A1:B" + std::to_string(rows) + ")/COUNT(B1:B" + std::to_string(rows) + ")");
+    source.SetCell("C2"_pos, "=1/0");
+    source.SetCell("C3"_pos, "=B1");
+    source.SetCell("C4"_pos, "");
+    // Копия, ссылка которой ушла за край таблицы
+    source.SetCell("D2"_pos, "=D1+1");
+    source.FillRange("D2"_pos, {"D1"_pos, "D3"_pos});
+
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "spreadsheet_snapshot_test.bin";
+    source.SaveSnapshot(path);
+
+    FormulaCacheStats before = GetFormulaCacheStats();
+    std::unique_ptr<Sheet> loaded = Sheet::LoadSnapshot(path);
+    FormulaCacheStats after = GetFormulaCacheStats();
+    // Протянутые копии разбираются одним выражением
+    ASSERT(after.hits + after.misses - before.hits - before.misses < 10);
+
+    std::ostringstream texts;
+    std::ostringstream loaded_texts;
+    source.PrintTexts(texts);
+    loaded->PrintTexts(loaded_texts);
+    ASSERT_EQUAL(loaded_texts.str(), texts.str());
+    std::ostringstream values;
+    std::ostringstream loaded_values;
+    source.PrintValues(values);
+    loaded->PrintValues(loaded_values);
+    ASSERT_EQUAL(loaded_values.str(), values.str());
+    ASSERT_EQUAL(loaded->GetCell("D1"_pos)->GetText(), "=#REF!+1");
+    ASSERT_EQUAL(loaded->GetCell("C4"_pos)->GetText(), "");
+
+    // Граф зависимостей восстановлен: правка доходит до всех копий
+    for (Sheet* sheet : {&source, loaded.get()}) {
+        sheet->SetCell("A1"_pos, "0.5");
+        sheet->SetCell("B2"_pos, "3");
+    }
+    ASSERT_EQUAL(loaded->GetCell({rows - 1, 0})->GetValue(), source.GetCell({rows - 1, 0})->GetValue());
+    ASSERT_EQUAL(loaded->GetCell("C1"_pos)->GetValue(), source.GetCell("C1"_pos)->GetValue());
+    try {
+        loaded->SetCell("A1"_pos, "=A5");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    // Повреждённый файл не открывается
+    std::string bytes;
+    {
+        std::ifstream file(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    auto expect_rejected = [&](const std::string& data) {
+        {
+            std::ofstream file(path, std::ios::binary | std::ios::trunc);
+            file << data;
+        }
+        try {
+            Sheet::LoadSnapshot(path);
+            ASSERT(false);
+        } catch (const SnapshotException&) {
+        }
+    };
+    std::string flipped = bytes;
+    flipped[bytes.size() / 2] ^= 1;
+    expect_rejected(flipped);
+    expect_rejected(bytes.substr(0, bytes.size() - 8));
+    expect_rejected("not a snapshot");
+    std::string future = bytes;
+    future[8] = 2;
+    expect_rejected(future);
+    std::filesystem::remove(path);
+}
+
+// Загрузка растёт линейно с числом формул. Квадратная сетка, где каждая
+// формула ссылается на соседей слева и сверху, в 64 раза большая грузится
+// не дольше 160 времён меньшей: линейный рост даёт около 90, а хеши,
+// совпадавшие у сотен ячеек, давали больше 200.
+void TestLoadScaling() {
+    // Ячейки квадратной области не делят хеши
+    std::unordered_set<std::size_t> hashes;
+    for (int row = 0; row < 512; ++row) {
+        for (int col = 0; col < 512; ++col) {
+            hashes.insert(PositionHasher{}({row, col}));
+        }
+    }
+    ASSERT_EQUAL(hashes.size(), 512u * 512u);
+
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "spreadsheet_scaling_test.bin";
+    // Лучшее из трёх времён загрузки снимка и текста сетки n x n
+    auto measure = [&](int n) {
+        Sheet source;
+        for (int i = 0; i < n; ++i) {
+            source.SetCell({0, i}, "1");
+            source.SetCell({i, 0}, "1");
+        }
+        source.SetCell("B2"_pos, "=A2+B1");
+        source.FillRange("B2"_pos, {"B2"_pos, {n - 1, n - 1}});
+        source.SaveSnapshot(path);
+        std::ostringstream texts;
+        source.PrintTexts(texts);
+
+        auto best = std::chrono::steady_clock::duration::max();
+        for (int run = 0; run < 3; ++run) {
+            auto start = std::chrono::steady_clock::now();
+            std::unique_ptr<Sheet> loaded = Sheet::LoadSnapshot(path);
+            Sheet parsed;
+            std::istringstream input(texts.str());
+            parsed.LoadDelimited(input);
+            best = std::min(best, std::chrono::steady_clock::now() - start);
+
+            ASSERT_EQUAL(loaded->GetCell({n - 1, n - 1})->GetValue(), source.GetCell({n - 1, n - 1})->GetValue());
+            ASSERT_EQUAL(parsed.GetCell({n - 1, n - 1})->GetValue(), source.GetCell({n - 1, n - 1})->GetValue());
+        }
+        return std::chrono::duration<double>(best).count();
+    };
+    double small = measure(32);
+    double large = measure(256);
+    std::filesystem::remove(path);
+    ASSERT(large < 160 * small);
+}
+
+void TestExport() {
+    // Эталон - печать по всем позициям через интерфейс ячеек
+    auto print_naive = [](const SheetInterface& sheet, std::ostream& output, bool values) {
+        Size size = sheet.GetPrintableSize();
+        for (int row = 0; row < size.rows; ++row) {
+            for (int col = 0; col < size.cols; ++col) {
+                if (col > 0) {
+                    output << '\t';
+                }
+                if (const CellInterface* cell = sheet.GetCell({row, col})) {
+                    if (values) {
+                        output << cell->GetValue();
+                    } else {
+                        output << cell->GetText();
+                    }
+                }
+            }
+            output << '\n';
+        }
+    };
+    auto check = [&](const Sheet& sheet, std::ostringstream& output, std::ostringstream& expected) {
+        for (bool values : {true, false}) {
+            output.str({});
+            expected.str({});
+            values ? sheet.PrintValues(output) : sheet.PrintTexts(output);
+            print_naive(sheet, expected, values);
+            ASSERT_EQUAL(output.str(), expected.str());
+        }
+    };
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=1/3");
+    sheet.SetCell("B1"_pos, "=1234567*1");
+    sheet.SetCell("C1"_pos, "=0.0001-1");
+    sheet.SetCell("E1"_pos, "=1/0");
+    sheet.SetCell("A2"_pos, "'=quoted");
+    sheet.SetCell("D2"_pos, "0.1");
+    sheet.SetCell("A4"_pos, "");
+    sheet.SetCell("B4"_pos, "=A1*1e20");
+    // Разреженная широкая таблица: ячейки в разных плитках
+    sheet.SetCell({300, 5000}, "far");
+    sheet.SetCell({300, 70}, "=B4/7");
+    sheet.SetCell({299, 64}, "=-2.5");
+    std::ostringstream output;
+    std::ostringstream expected;
+    check(sheet, output, expected);
+
+    // Нестандартный формат потока соблюдается
+    output << std::fixed << std::setprecision(2);
+    expected << std::fixed << std::setprecision(2);
+    check(sheet, output, expected);
+
+    // Значения пересчитываются перед печатью
+    sheet.SetCell("A1"_pos, "3");
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(values.str().substr(0, 2), "3\t");
+}
+
+void TestParallelExport() {
+    Sheet sheet;
+    for (int row = 0; row < 5000; ++row) {
+        if (row % 7 == 3) {
+            continue;
+        }
+        std::string name = std::to_string(row + 1);
+        sheet.SetCell({row, 0}, std::to_string(row) + ".5");
+        sheet.SetCell({row, row % 5 + 1}, "=A" + name + "/3");
+        if (row % 100 == 0) {
+            sheet.SetCell({row, 200}, "'=row" + name);
+        }
+    }
+    std::ostringstream values;
+    std::ostringstream texts;
+    sheet.PrintValues(values);
+    sheet.PrintTexts(texts);
+
+    // Блоки строк печатаются в нескольких потоках, результат тот же байт в байт
+    sheet.SetWorkerCount(4);
+    std::ostringstream parallel_values;
+    std::ostringstream parallel_texts;
+    sheet.PrintValues(parallel_values);
+    sheet.PrintTexts(parallel_texts);
+    ASSERT(parallel_values.str() == values.str());
+    ASSERT(parallel_texts.str() == texts.str());
+
+    // Пересчёт перед печатью и нестандартный формат чисел
+    sheet.SetCell("A1"_pos, "9");
+    values.str({});
+    parallel_values.str({});
+    values << std::setprecision(3);
+    parallel_values << std::setprecision(3);
+    sheet.SetWorkerCount(1);
+    sheet.PrintValues(values);
+    sheet.SetWorkerCount(3);
+    sheet.PrintValues(parallel_values);
+    ASSERT(parallel_values.str() == values.str());
+    ASSERT_EQUAL(values.str().substr(0, 4), "9\t3\t");
+}
+
+void TestJournal() {
+    std::filesystem::path dir = std::filesystem::temp_directory_path();
+    std::filesystem::path journal = dir / "spreadsheet_journal_test.wal";
+    std::filesystem::path snapshot = dir / "spreadsheet_journal_test.bin";
+    std::filesystem::remove(journal);
+    std::filesystem::remove(snapshot);
+
+    auto expect_same = [](const Sheet& lhs, const Sheet& rhs) {
+        std::ostringstream lhs_texts;
+        std::ostringstream rhs_texts;
+        lhs.PrintTexts(lhs_texts);
+        rhs.PrintTexts(rhs_texts);
+        ASSERT_EQUAL(lhs_texts.str(), rhs_texts.str());
+        std::ostringstream lhs_values;
+        std::ostringstream rhs_values;
+        lhs.PrintValues(lhs_values);
+        rhs.PrintValues(rhs_values);
+        ASSERT_EQUAL(lhs_values.str(), rhs_values.str());
+    };
+
+    // Все виды правок попадают в журнал, неудачные - нет
+    Sheet sheet;
+    sheet.OpenJournal(journal);
+    for (int row = 0; row < 500; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row));
+    }
+    sheet.SetCell("B1"_pos, "=A1+1");
+    sheet.FillDown("B1"_pos, 499);
+    sheet.SetCell("C1"_pos, "=SUM(B1:B500)");
+    sheet.SetCell("C2"_pos, "'=text");
+    sheet.SetCell("C3"_pos, "");
+    sheet.SetCell("C4"_pos, "temporary");
+    sheet.ClearCell("C4"_pos);
+    sheet.SetCell("A1"_pos, "  =  A2 * 2 ");
+    std::istringstream input("\t\t\t=C1/2\n\t\t\tx\n");
+    sheet.LoadDelimited(input);
+    try {
+        sheet.SetCell("A2"_pos, "=C1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    sheet.SyncJournal();
+
+    {
+        Sheet replayed;
+        replayed.SetWorkerCount(3);
+        replayed.OpenJournal(journal);
+        replayed.CloseJournal();
+        expect_same(replayed, sheet);
+    }
+
+    // После сжатия журнал пуст, а таблица восстанавливается из снимка и
+    // новых правок
+    sheet.CompactJournal(snapshot);
+    ASSERT(std::filesystem::file_size(journal) < 64);
+    sheet.SetCell("A3"_pos, "100");
+    sheet.ClearCell("D2"_pos);
+    sheet.CloseJournal();
+    {
+        std::unique_ptr<Sheet> restored = Sheet::LoadSnapshot(snapshot);
+        restored->OpenJournal(journal);
+        restored->CloseJournal();
+        expect_same(*restored, sheet);
+    }
+
+    // Журнал не подменился: сжатие сообщает об ошибке, а правки дописываются
+    // в прежний журнал, который вместе с новым снимком даёт ту же таблицу
+    std::filesystem::path blocked = journal;
+    blocked += ".tmp";
+    std::filesystem::create_directory(blocked);
+    sheet.OpenJournal(journal);
+    try {
+        sheet.CompactJournal(snapshot);
+        ASSERT(false);
+    } catch (const std::runtime_error&) {
+    }
+    std::filesystem::remove_all(blocked);
+    sheet.SetCell("A4"_pos, "=A3*3");
+    sheet.CloseJournal();
+    {
+        std::unique_ptr<Sheet> restored = Sheet::LoadSnapshot(snapshot);
+        restored->OpenJournal(journal);
+        restored->CloseJournal();
+        expect_same(*restored, sheet);
+    }
+
+    // Недописанная при сбое запись отбрасывается, журнал остаётся рабочим
+    auto size = std::filesystem::file_size(journal);
+    {
+        std::ofstream file(journal, std::ios::binary | std::ios::app);
+        file << std::string("\x20\x00\x00\x00garbage", 11);
+    }
+    {
+        std::unique_ptr<Sheet> restored = Sheet::LoadSnapshot(snapshot);
+        restored->OpenJournal(journal);
+        ASSERT_EQUAL(std::filesystem::file_size(journal), size);
+        restored->SetCell("E1"_pos, "=A3");
+        restored->CloseJournal();
+        ASSERT(std::filesystem::file_size(journal) > size);
+        sheet.SetCell("E1"_pos, "=A3");
+        expect_same(*restored, sheet);
+    }
+
+    // Копия со ссылками за краем восстанавливается той же формулой, а не
+    // своим текстом с #REF!: заполнение из неё снова даёт ссылки
+    std::filesystem::remove(journal);
+    {
+        Sheet filled;
+        filled.OpenJournal(journal);
+        filled.SetCell("A1"_pos, "5");
+        filled.SetCell("B2"_pos, "=SUM(A1:A2)+A1");
+        filled.FillRange("B2"_pos, {"B1"_pos, "C3"_pos});
+        ASSERT_EQUAL(filled.GetCell("B1"_pos)->GetText(), "=SUM(#REF!)+#REF!");
+        filled.CloseJournal();
+
+        Sheet replayed;
+        replayed.OpenJournal(journal);
+        replayed.CloseJournal();
+        expect_same(replayed, filled);
+        replayed.FillRange("B1"_pos, {"D2"_pos, "D2"_pos});
+        ASSERT_EQUAL(replayed.GetCell("D2"_pos)->GetText(), "=SUM(C1:C2)+C1");
+    }
+
+
+#if __has_include(<sys/resource.h>)
+    // Файл журнала перестал расти: правки продолжают применяться к таблице,
+    // а ошибку журнала сообщает SyncJournal()
+    std::filesystem::remove(journal);
+    {
+        Sheet broken;
+        broken.OpenJournal(journal);
+        rlimit limit;
+        getrlimit(RLIMIT_FSIZE, &limit);
+        rlimit capped = limit;
+        capped.rlim_cur = 4096;
+        auto handler = std::signal(SIGXFSZ, SIG_IGN);
+        setrlimit(RLIMIT_FSIZE, &capped);
+        broken.SetCell("A1"_pos, std::string(8192, 'x'));
+        try {
+            broken.SyncJournal();
+            ASSERT(false);
+        } catch (const std::runtime_error&) {
+        }
+        broken.SetCell("A2"_pos, "=1+1");
+        broken.ClearCell("A1"_pos);
+        setrlimit(RLIMIT_FSIZE, &limit);
+        std::signal(SIGXFSZ, handler);
+        ASSERT_EQUAL(broken.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT(broken.GetCell("A1"_pos) == nullptr);
+        try {
+            broken.SyncJournal();
+            ASSERT(false);
+        } catch (const std::runtime_error&) {
+        }
+        broken.CloseJournal();
+    }
+#endif
+
+    std::filesystem::remove(journal);
+    std::filesystem::remove(snapshot);
+}
 }  // namespace
 
 int main() {
@@ -363,6 +1890,7 @@ int main() {
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
     RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestFormulaReadDoesNotReparse);
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestErrorArithmetic);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
@@ -371,4 +1899,32 @@ int main() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestDependentsRecalculated);
+    RUN_TEST(tr, TestCircularReferencesDiamond);
+    RUN_TEST(tr, TestRecalculationDiamondChain);
+    RUN_TEST(tr, TestParallelRecalculation);
+    RUN_TEST(tr, TestFormulaDeepExpression);
+    RUN_TEST(tr, TestFormulaParserEdgeCases);
+    RUN_TEST(tr, TestErrorPropagation);
+    RUN_TEST(tr, TestPrintableSizeAfterClear);
+    RUN_TEST(tr, TestCompactCellContents);
+    RUN_TEST(tr, TestNumericTextInFormulas);
+    RUN_TEST(tr, TestCellMemoryReclaimed);
+    RUN_TEST(tr, TestFormulaParseAllocations);
+    RUN_TEST(tr, TestFormulaEvaluateDoesNotAllocate);
+    RUN_TEST(tr, TestRangeAggregates);
+    RUN_TEST(tr, TestRangeAggregatesAcrossTiles);
+    RUN_TEST(tr, TestRangeDependencies);
+    RUN_TEST(tr, TestColumnAggregates);
+    RUN_TEST(tr, TestFillFormulas);
+    RUN_TEST(tr, TestColumnBatchEvaluation);
+    RUN_TEST(tr, TestConstantFolding);
+    RUN_TEST(tr, TestFormulaParseCache);
+    RUN_TEST(tr, TestLoadDelimited);
+    RUN_TEST(tr, TestRefErrorRoundTrip);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestLoadScaling);
+    RUN_TEST(tr, TestExport);
+    RUN_TEST(tr, TestParallelExport);
+    RUN_TEST(tr, TestJournal);
 }
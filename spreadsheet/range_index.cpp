@@ -0,0 +1,84 @@
+#include "range_index.h"
+
+static_assert((Position::MAX_ROWS & (Position::MAX_ROWS - 1)) == 0
+              && (Position::MAX_COLS & (Position::MAX_COLS - 1)) == 0,
+              "RangeIndex needs power-of-two grid sizes");
+static_assert(2 * Position::MAX_ROWS <= (1 << 16) && 2 * Position::MAX_COLS <= (1 << 16),
+              "RangeIndex::SlotKey needs node numbers below 2^16");
+
+void RangeIndex::Insert(Range range, Position formula)
+{
+    Decompose(range.first.col, range.last.col, Position::MAX_COLS, [&](std::uint32_t col_node)
+    {
+        ColumnNode& column = columns_[col_node];
+
+        Decompose(range.first.row, range.last.row, Position::MAX_ROWS, [&](std::uint32_t row_node)
+        {
+            std::vector<Entry>& list = column[row_node];
+            auto [slot, inserted] = slots_.try_emplace(SlotKey(col_node, row_node, formula),
+                                                       static_cast<std::uint32_t>(list.size()));
+
+            if(inserted)
+            {
+                list.push_back({formula, 1});
+            }
+            else
+            {
+                ++list[slot->second].count;
+            }
+        });
+    });
+}
+
+void RangeIndex::Erase(Range range, Position formula)
+{
+    Decompose(range.first.col, range.last.col, Position::MAX_COLS, [&](std::uint32_t col_node)
+    {
+        auto column = columns_.find(col_node);
+
+        if(column == columns_.end())
+        {
+            return;
+        }
+
+        Decompose(range.first.row, range.last.row, Position::MAX_ROWS, [&](std::uint32_t row_node)
+        {
+            auto slot = slots_.find(SlotKey(col_node, row_node, formula));
+
+            if(slot == slots_.end())
+            {
+                return;
+            }
+
+            auto formulas = column->second.find(row_node);
+            std::vector<Entry>& list = formulas->second;
+            std::uint32_t index = slot->second;
+
+            if(--list[index].count > 0)
+            {
+                return;
+            }
+
+            // На место удалённой записи встаёт последняя
+            slots_.erase(slot);
+
+            if(index + 1 < list.size())
+            {
+                list[index] = list.back();
+                slots_[SlotKey(col_node, row_node, list[index].formula)] = index;
+            }
+
+            list.pop_back();
+
+            if(list.empty())
+            {
+                column->second.erase(formulas);
+            }
+        });
+
+        if(column->second.empty())
+        {
+            columns_.erase(column);
+        }
+    });
+}
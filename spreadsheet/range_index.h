@@ -0,0 +1,123 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Индекс формул по диапазонам, на которые они ссылаются. Отвечает на вопрос
+// "какие формулы зависят от ячейки X", не раскладывая диапазоны на ячейки.
+//
+// Устроен как двумерное дерево отрезков: дерево по столбцам, в каждом узле
+// которого - дерево по строкам. Диапазон раскладывается на O(log C) узлов по
+// столбцам и в каждом из них на O(log R) узлов по строкам, и формула
+// записывается в эти узлы. Ячейку содержат ровно те диапазоны, что записаны
+// на путях от её листьев к корням, поэтому запрос обходит O(log C * log R)
+// узлов. Хранятся только непустые узлы.
+//
+// Место каждой формулы в списке узла записано отдельно, так что удаление
+// находит её сразу, а не перебором списка, и тоже обходится в
+// O(log C * log R) даже для узлов, на которые ссылаются тысячи формул.
+class RangeIndex
+{
+public:
+    void Insert(Range range, Position formula);
+    void Erase(Range range, Position formula);
+
+    // Вызывает callback(formula) для каждой записи диапазона, содержащего
+    // cell. Формула, у которой таких диапазонов несколько, встретится
+    // несколько раз.
+    template <typename Callback>
+    void ForEachContaining(Position cell, Callback&& callback) const
+    {
+        if(columns_.empty())
+        {
+            return;
+        }
+
+        for(std::uint32_t col_node = LeafNode(cell.col, Position::MAX_COLS); col_node > 0; col_node >>= 1)
+        {
+            auto column = columns_.find(col_node);
+
+            if(column == columns_.end())
+            {
+                continue;
+            }
+
+            for(std::uint32_t row_node = LeafNode(cell.row, Position::MAX_ROWS); row_node > 0; row_node >>= 1)
+            {
+                auto formulas = column->second.find(row_node);
+
+                if(formulas == column->second.end())
+                {
+                    continue;
+                }
+
+                for(const Entry& entry : formulas->second)
+                {
+                    for(std::uint32_t i = 0; i < entry.count; ++i)
+                    {
+                        callback(entry.formula);
+                    }
+                }
+            }
+        }
+    }
+
+    bool IsEmpty() const
+    {
+        return columns_.empty();
+    }
+
+private:
+    // Узлы нумеруются как в двоичной куче: корень - 1, дети узла i - 2i и
+    // 2i + 1, лист для индекса x - size + x. Размеры сетки - степени двойки.
+    static std::uint32_t LeafNode(int index, int size)
+    {
+        return static_cast<std::uint32_t>(size + index);
+    }
+
+    // Вызывает callback(node) для узлов, которые в точности покрывают
+    // отрезок [first, last]
+    template <typename Callback>
+    static void Decompose(int first, int last, int size, Callback&& callback)
+    {
+        std::uint32_t left = LeafNode(first, size);
+        std::uint32_t right = LeafNode(last, size) + 1;
+
+        for(; left < right; left >>= 1, right >>= 1)
+        {
+            if(left & 1)
+            {
+                callback(left++);
+            }
+
+            if(right & 1)
+            {
+                callback(--right);
+            }
+        }
+    }
+
+    // Ключ места формулы в списке узла: номера узлов меньше 2^16, как и
+    // строки и столбцы
+    static std::uint64_t SlotKey(std::uint32_t col_node, std::uint32_t row_node, Position formula)
+    {
+        return static_cast<std::uint64_t>(col_node) << 48 | static_cast<std::uint64_t>(row_node) << 32
+               | static_cast<std::uint64_t>(formula.row) << 16 | static_cast<std::uint64_t>(formula.col);
+    }
+
+    // Формула и число её диапазонов, записанных в узел
+    struct Entry
+    {
+        Position formula;
+        std::uint32_t count;
+    };
+
+    using ColumnNode = std::unordered_map<std::uint32_t, std::vector<Entry>>;
+
+    std::unordered_map<std::uint32_t, ColumnNode> columns_;
+    // Номер записи формулы в списке узла по SlotKey()
+    std::unordered_map<std::uint64_t, std::uint32_t> slots_;
+};
@@ -0,0 +1,175 @@
+#include "range_kernels.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+// Слоты с тегом больше Empty - текст и формулы, их ядра отдают вызывающему
+static_assert(CellSlot::Tag::None < CellSlot::Tag::Empty
+              && CellSlot::Tag::Empty < CellSlot::Tag::Text
+              && CellSlot::Tag::Empty < CellSlot::Tag::Formula);
+
+const std::int64_t EMPTY_BITS = static_cast<std::int64_t>(CellSlot::MakeEmpty().GetBits());
+
+// Обрабатывает слоты по одному - для хвостов и платформ без SIMD
+bool AccumulateScalar(const CellSlot* slots, size_t count, size_t stride, RangeAccumulator& acc)
+{
+    bool has_special = false;
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        const CellSlot& slot = slots[i * stride];
+
+        switch(slot.GetTag())
+        {
+            case CellSlot::Tag::Number:
+                acc.Add(slot.GetNumber());
+                break;
+            case CellSlot::Tag::Text:
+            case CellSlot::Tag::Formula:
+                has_special = true;
+                break;
+            default:
+                break;
+        }
+    }
+
+    return has_special;
+}
+
+#if defined(__AVX2__)
+bool AccumulateVector(const CellSlot* slots, size_t count, size_t stride, RangeAccumulator& acc)
+{
+    const double* data = reinterpret_cast<const double*>(slots);
+    const long long step = static_cast<long long>(stride);
+    const __m256i gather_index = _mm256_set_epi64x(3 * step, 2 * step, step, 0);
+    const __m256d inf = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+    const __m256d neg_inf = _mm256_set1_pd(-std::numeric_limits<double>::infinity());
+    const __m256i empty_bits = _mm256_set1_epi64x(EMPTY_BITS);
+
+    __m256d sum = _mm256_setzero_pd();
+    __m256d min = inf;
+    __m256d max = neg_inf;
+    __m256i counts = _mm256_setzero_si256();
+    __m256i special = _mm256_setzero_si256();
+
+    size_t i = 0;
+
+    for(; i + 4 <= count; i += 4)
+    {
+        __m256d values = stride == 1
+            ? _mm256_loadu_pd(data + i)
+            : _mm256_i64gather_pd(data + i * stride, gather_index, 8);
+
+        // NaN-слоты не упорядочены сами с собой
+        __m256d is_number = _mm256_cmp_pd(values, values, _CMP_ORD_Q);
+        __m256i bits = _mm256_castpd_si256(values);
+
+        sum = _mm256_add_pd(sum, _mm256_and_pd(values, is_number));
+        min = _mm256_min_pd(min, _mm256_blendv_pd(inf, values, is_number));
+        max = _mm256_max_pd(max, _mm256_blendv_pd(neg_inf, values, is_number));
+        // маска числа - это -1 в каждой 64-битной дорожке
+        counts = _mm256_sub_epi64(counts, _mm256_castpd_si256(is_number));
+        special = _mm256_or_si256(special,
+            _mm256_andnot_si256(_mm256_castpd_si256(is_number), _mm256_cmpgt_epi64(bits, empty_bits)));
+    }
+
+    alignas(32) double sums[4];
+    alignas(32) double mins[4];
+    alignas(32) double maxs[4];
+    alignas(32) long long lane_counts[4];
+
+    _mm256_store_pd(sums, sum);
+    _mm256_store_pd(mins, min);
+    _mm256_store_pd(maxs, max);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lane_counts), counts);
+
+    for(int lane = 0; lane < 4; ++lane)
+    {
+        acc.sum += sums[lane];
+        acc.min = std::min(acc.min, mins[lane]);
+        acc.max = std::max(acc.max, maxs[lane]);
+        acc.count += static_cast<size_t>(lane_counts[lane]);
+    }
+
+    bool has_special = !_mm256_testz_si256(special, special);
+    return AccumulateScalar(slots + i * stride, count - i, stride, acc) || has_special;
+}
+#elif defined(__SSE2__)
+bool AccumulateVector(const CellSlot* slots, size_t count, size_t stride, RangeAccumulator& acc)
+{
+    const double* data = reinterpret_cast<const double*>(slots);
+    const __m128d inf = _mm_set1_pd(std::numeric_limits<double>::infinity());
+    const __m128d neg_inf = _mm_set1_pd(-std::numeric_limits<double>::infinity());
+    // В SSE2 нет 64-битного сравнения, но у всех NaN-слотов старшие 16 бит
+    // одинаковы, так что тег сравнивается по старшему 32-битному слову
+    const __m128i empty_high = _mm_set1_epi32(static_cast<int>(EMPTY_BITS >> 32));
+
+    __m128d sum = _mm_setzero_pd();
+    __m128d min = inf;
+    __m128d max = neg_inf;
+    __m128i counts = _mm_setzero_si128();
+    int special = 0;
+
+    size_t i = 0;
+
+    for(; i + 2 <= count; i += 2)
+    {
+        __m128d values = stride == 1
+            ? _mm_loadu_pd(data + i)
+            : _mm_loadh_pd(_mm_load_sd(data + i * stride), data + (i + 1) * stride);
+
+        // NaN-слоты не упорядочены сами с собой
+        __m128d is_number = _mm_cmpord_pd(values, values);
+        __m128d numbers = _mm_and_pd(values, is_number);
+
+        sum = _mm_add_pd(sum, numbers);
+        min = _mm_min_pd(min, _mm_or_pd(numbers, _mm_andnot_pd(is_number, inf)));
+        max = _mm_max_pd(max, _mm_or_pd(numbers, _mm_andnot_pd(is_number, neg_inf)));
+        // маска числа - это -1 в каждой 64-битной дорожке
+        counts = _mm_sub_epi64(counts, _mm_castpd_si128(is_number));
+
+        // знаковый бит дорожки берётся из сравнения её старшего слова
+        __m128i above_empty = _mm_cmpgt_epi32(_mm_castpd_si128(values), empty_high);
+        special |= _mm_movemask_pd(_mm_andnot_pd(is_number, _mm_castsi128_pd(above_empty)));
+    }
+
+    double sums[2];
+    double mins[2];
+    double maxs[2];
+    long long lane_counts[2];
+
+    _mm_storeu_pd(sums, sum);
+    _mm_storeu_pd(mins, min);
+    _mm_storeu_pd(maxs, max);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lane_counts), counts);
+
+    for(int lane = 0; lane < 2; ++lane)
+    {
+        acc.sum += sums[lane];
+        acc.min = std::min(acc.min, mins[lane]);
+        acc.max = std::max(acc.max, maxs[lane]);
+        acc.count += static_cast<size_t>(lane_counts[lane]);
+    }
+
+    return AccumulateScalar(slots + i * stride, count - i, stride, acc) || special != 0;
+}
+#else
+bool AccumulateVector(const CellSlot* slots, size_t count, size_t stride, RangeAccumulator& acc)
+{
+    return AccumulateScalar(slots, count, stride, acc);
+}
+#endif
+}
+
+bool AccumulateNumberSlots(const CellSlot* slots, size_t count, size_t stride,
+                           RangeAccumulator& acc)
+{
+    return AccumulateVector(slots, count, stride, acc);
+}
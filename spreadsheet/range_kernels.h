@@ -0,0 +1,17 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+
+#include <cstddef>
+
+// Складывает в acc числа среди count слотов, идущих в памяти с шагом stride
+// (1 - строка плитки, размер плитки - столбец). Слоты без ячейки и с пустым
+// текстом пропускаются. Возвращает true, если среди слотов встретились текст
+// или формулы: их значения ядро не знает, и вызывающий разбирает их сам.
+//
+// Числа хранятся в слотах как обычные конечные double, а всё остальное - как
+// NaN, поэтому ядро отбирает числа сравнением "упорядочено" и обрабатывает
+// по четыре (AVX2) или по два (SSE2) слота за раз.
+bool AccumulateNumberSlots(const CellSlot* slots, size_t count, size_t stride,
+                           RangeAccumulator& acc);
@@ -2,11 +2,21 @@
 
 #include "cell.h"
 #include "common.h"
+#include "journal.h"
+#include "range_kernels.h"
+#include "snapshot.h"
 
 #include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <locale>
 #include <optional>
+#include <sstream>
+#include <string_view>
 
 using namespace std::literals;
 
@@ -21,182 +31,1645 @@ void CheckPos(Position pos)
     }
 }
 
+namespace
+{
+// Текст, который совпадает с кратчайшей записью своего числа, хранится прямо
+// в слоте как число и восстанавливается без потерь.
+std::optional<double> ParseCanonicalNumber(const std::string& text)
+{
+    std::optional<double> number = ParseNumericText(text);
+    
+    if(!number.has_value())
+    {
+        return std::nullopt;
+    }
+    
+    char buffer[32];
+    auto [last, error] = std::to_chars(std::begin(buffer), std::end(buffer), *number);
+    
+    if(error != std::errc() || std::string_view(buffer, last - buffer) != text)
+    {
+        return std::nullopt;
+    }
+    
+    return number;
+}
+
+void AppendNumber(std::string& out, double number)
+{
+    char buffer[32];
+    auto [last, error] = std::to_chars(std::begin(buffer), std::end(buffer), number);
+    assert(error == std::errc());
+    
+    out.append(buffer, last);
+}
+
+std::string FormatNumber(double number)
+{
+    std::string text;
+    AppendNumber(text, number);
+    return text;
+}
+
+// Печатает ли поток double так же, как to_chars с шестью значащими цифрами
+// (формат по умолчанию, как у printf("%g"))
+bool HasDefaultNumberFormat(const std::ostream& output)
+{
+    const std::ios::fmtflags NUMBER_FLAGS = std::ios::floatfield | std::ios::showpoint
+                                            | std::ios::showpos | std::ios::uppercase;
+    
+    return output.precision() == 6 && (output.flags() & NUMBER_FLAGS) == 0
+        && output.getloc() == std::locale::classic();
+}
+
+// Значение формулы печатается так же, как operator<<: через to_chars, если
+// формат потока number_format по умолчанию (nullptr), иначе через сам формат
+void AppendFormulaValue(std::string& out, double number, const std::ostream* number_format)
+{
+    if(number_format == nullptr)
+    {
+        char buffer[32];
+        auto [last, error] = std::to_chars(std::begin(buffer), std::end(buffer), number,
+                                           std::chars_format::general, 6);
+        assert(error == std::errc());
+        
+        out.append(buffer, last);
+        return;
+    }
+    
+    std::ostringstream stream;
+    stream.copyfmt(*number_format);
+    stream.width(0);
+    stream << number;
+    out += stream.str();
+}
+
+// Все ссылки формулы из pos ведут в ячейки, стоящие раньше неё при обходе
+// по строкам. Если так у каждой формулы графа, позиция вдоль любого ребра
+// только убывает и цикла в нём быть не может.
+bool RefersBackward(Position pos, const std::vector<Position>& refs, const std::vector<Range>& ranges)
+{
+    return std::all_of(refs.begin(), refs.end(), [pos](Position ref) { return ref < pos; })
+           && std::all_of(ranges.begin(), ranges.end(), [pos](const Range& range) { return range.last < pos; });
+}
+
+}
+
+// Ячейка, прочитанная загрузчиком, но ещё не записанная в таблицу. Формула
+// уже разобрана, число распознано, остальное - текст.
+struct StagedCell
+{
+    Position pos;
+    std::unique_ptr<FormulaInterface> formula;
+    std::optional<double> number;
+    std::string text;
+};
+
+namespace
+{
+
+StagedCell StageCell(Position pos, std::string_view field)
+{
+    CheckPos(pos);
+    
+    StagedCell cell{pos, nullptr, std::nullopt, {}};
+    
+    if(field.size() > 1 && field[0] == FORMULA_SIGN)
+    {
+        try
+        {
+            cell.formula = ParseFormula(std::string(field.substr(1)));
+        }
+        catch(FormulaException& e)
+        {
+            throw FormulaException("Error. Formula in " + pos.ToString() + " failed parsing!");
+        }
+        
+        return cell;
+    }
+    
+    cell.text = std::string(field);
+    cell.number = ParseCanonicalNumber(cell.text);
+    
+    if(cell.number.has_value())
+    {
+        cell.text.clear();
+    }
+    
+    return cell;
+}
+
+// Разбирает строки text, первая из которых - строка таблицы first_row.
+// Пустые поля ячеек не создают.
+std::vector<StagedCell> StageRows(std::string_view text, int first_row, char delimiter)
+{
+    std::vector<StagedCell> cells;
+    int row = first_row;
+    size_t line_begin = 0;
+    
+    while(line_begin < text.size())
+    {
+        size_t line_end = std::min(text.find('\n', line_begin), text.size());
+        std::string_view line = text.substr(line_begin, line_end - line_begin);
+        
+        if(!line.empty() && line.back() == '\r')
+        {
+            line.remove_suffix(1);
+        }
+        
+        int col = 0;
+        size_t field_begin = 0;
+        
+        while(true)
+        {
+            size_t field_end = std::min(line.find(delimiter, field_begin), line.size());
+            
+            if(field_end > field_begin)
+            {
+                cells.push_back(StageCell({row, col}, line.substr(field_begin, field_end - field_begin)));
+            }
+            
+            if(field_end == line.size())
+            {
+                break;
+            }
+            
+            field_begin = field_end + 1;
+            ++col;
+        }
+        
+        ++row;
+        line_begin = line_end + 1;
+    }
+    
+    return cells;
+}
+}
+
+size_t Sheet::TileIndex(Position pos)
+{
+    return static_cast<size_t>(pos.row / TILE_SIZE) * TILE_COLS + pos.col / TILE_SIZE;
+}
+
+size_t Sheet::IndexInTile(Position pos)
+{
+    return static_cast<size_t>(pos.row % TILE_SIZE) * TILE_SIZE + pos.col % TILE_SIZE;
+}
+
+CellSlot Sheet::FindSlot(Position pos) const
+{
+    if(tiles_.empty())
+    {
+        return {};
+    }
+    
+    const std::unique_ptr<Tile>& tile = tiles_[TileIndex(pos)];
+    return tile != nullptr ? tile->slots[IndexInTile(pos)] : CellSlot{};
+}
+
+CellSlot& Sheet::GetOrCreateSlot(Position pos)
+{
+    if(tiles_.empty())
+    {
+        tiles_.resize(static_cast<size_t>(TILE_ROWS) * TILE_COLS);
+        row_counts_.assign(Position::MAX_ROWS, 0);
+        col_counts_.assign(Position::MAX_COLS, 0);
+    }
+    
+    std::unique_ptr<Tile>& tile = tiles_[TileIndex(pos)];
+    
+    if(tile == nullptr)
+    {
+        tile = std::make_unique<Tile>();
+    }
+    
+    CellSlot& slot = tile->slots[IndexInTile(pos)];
+    
+    if(slot.IsNone())
+    {
+        ++tile->count;
+        ++row_counts_[pos.row];
+        ++col_counts_[pos.col];
+        MaybeIncreaseSizeToIncludePosition(pos);
+    }
+    
+    return slot;
+}
+
+void Sheet::EraseSlot(Position pos)
+{
+    std::unique_ptr<Tile>& tile = tiles_[TileIndex(pos)];
+    tile->slots[IndexInTile(pos)] = CellSlot{};
+    
+    if(--tile->count == 0)
+    {
+        tile.reset();
+    }
+    
+    --row_counts_[pos.row];
+    --col_counts_[pos.col];
+    
+    while(height > 0 && row_counts_[height - 1] == 0)
+    {
+        --height;
+    }
+    
+    while(width > 0 && col_counts_[width - 1] == 0)
+    {
+        --width;
+    }
+}
+
+void Sheet::ReleaseSlot(CellSlot slot)
+{
+    switch(slot.GetTag())
+    {
+        case CellSlot::Tag::Text:
+            texts_.Release(slot.GetHandle());
+            break;
+        case CellSlot::Tag::Formula:
+            formulas_[slot.GetHandle()] = FormulaEntry{};
+            free_formulas_.push_back(slot.GetHandle());
+            break;
+        default:
+            break;
+    }
+}
+
+std::uint32_t Sheet::AddFormula(std::unique_ptr<FormulaInterface> formula)
+{
+    std::uint32_t handle;
+    
+    if(!free_formulas_.empty())
+    {
+        handle = free_formulas_.back();
+        free_formulas_.pop_back();
+    }
+    else
+    {
+        handle = static_cast<std::uint32_t>(formulas_.size());
+        formulas_.emplace_back();
+    }
+    
+    formulas_[handle].formula = std::move(formula);
+    return handle;
+}
+
 void Sheet::SetCell(Position pos, std::string text) 
 {
     CheckPos(pos);
     
-    if(pos.row >= height)
+    // Сначала текст разбирается и проверяется, и только потом таблица
+    // меняется, так что при исключении ячейка остаётся прежней
+    if(text.size() > 1 && text[0] == FORMULA_SIGN)
     {
-        height = pos.row + 1;
+        std::unique_ptr<FormulaInterface> formula;
+        
+        try
+        {
+            formula = ParseFormula(text.substr(1));
+        }
+        catch(FormulaException& e)
+        {
+            throw FormulaException("Error. Formula failed parsing!");
+        }
+        
+        SetFormula(pos, std::move(formula));
     }
-    if(pos.col >= width){
-        width = pos.col + 1;
+    else
+    {
+        CellSlot slot = CellSlot::MakeEmpty();
+        
+        if(!text.empty())
+        {
+            std::optional<double> number = ParseCanonicalNumber(text);
+            slot = number.has_value() ? CellSlot::MakeNumber(*number)
+                                      : CellSlot::MakeText(texts_.Intern(text));
+        }
+        
+        StoreSlot(pos, slot, {}, {});
+    }
+    
+    if(journal_)
+    {
+        journal_->Append(JournalRecord::Kind::Set, pos, text);
+    }
+}
+
+void Sheet::SetFormula(Position pos, std::unique_ptr<FormulaInterface> formula)
+{
+    std::vector<Position> refs = formula->GetSingleCellReferences();
+    std::vector<Range> ranges = formula->GetReferencedRanges();
+    
+    if(HasCyclicDependency(pos, refs, ranges))
+    {
+        throw CircularDependencyException("Cyclic dependency detected!");
+    }
+    
+    StoreSlot(pos, CellSlot::MakeFormula(AddFormula(std::move(formula))), std::move(refs),
+              std::move(ranges));
+}
+
+void Sheet::StoreSlot(Position pos, CellSlot slot, std::vector<Position> refs,
+                      std::vector<Range> ranges)
+{
+    ReleaseSlot(FindSlot(pos));
+    GetOrCreateSlot(pos) = slot;
+    
+    dirty_.erase(pos);
+    StoreRefs(pos, std::move(refs), std::move(ranges));
+    Invalidate(pos);
+    UpdateColumnAggregates(pos);
+}
+
+void Sheet::FillRange(Position source, Range target)
+{
+    CheckPos(source);
+    
+    if(!target.IsValid())
+    {
+        throw InvalidPositionException("Invalid Range!");
+    }
+    
+    CellSlot slot = FindSlot(source);
+    
+    if(slot.GetTag() != CellSlot::Tag::Formula)
+    {
+        // Значения копируются как есть: циклов они создать не могут
+        std::string text = GetCellText(source);
+        
+        for(int row = target.first.row; row <= target.last.row; ++row)
+        {
+            for(int col = target.first.col; col <= target.last.col; ++col)
+            {
+                if(Position{row, col} == source)
+                {
+                    continue;
+                }
+                
+                if(slot.IsNone())
+                {
+                    ClearCell({row, col});
+                }
+                else
+                {
+                    SetCell({row, col}, text);
+                }
+            }
+        }
+        
+        return;
+    }
+    
+    // Копия держит разобранное выражение, даже если исходная ячейка
+    // попадёт в заполняемый диапазон и будет перезаписана
+    std::unique_ptr<FormulaInterface> pattern = formulas_[slot.GetHandle()].formula->Shift(0, 0);
+    
+    // Прежнее содержимое заполненных ячеек - чтобы вернуть его, если
+    // очередная копия создаст цикл
+    std::vector<std::pair<Position, std::optional<std::string>>> previous;
+    
+    for(int row = target.first.row; row <= target.last.row; ++row)
+    {
+        for(int col = target.first.col; col <= target.last.col; ++col)
+        {
+            Position pos{row, col};
+            
+            if(pos == source)
+            {
+                continue;
+            }
+            
+            std::optional<std::string> text;
+            
+            if(!FindSlot(pos).IsNone())
+            {
+                text = GetCellText(pos);
+            }
+            
+            try
+            {
+                SetFormula(pos, pattern->Shift(row - source.row, col - source.col));
+            }
+            catch(const CircularDependencyException&)
+            {
+                // Откат в обратном порядке проходит через те же состояния
+                // таблицы, что и заполнение, поэтому циклов не создаёт
+                for(auto it = previous.rbegin(); it != previous.rend(); ++it)
+                {
+                    if(it->second.has_value())
+                    {
+                        SetCell(it->first, std::move(*it->second));
+                    }
+                    else
+                    {
+                        ClearCell(it->first);
+                    }
+                }
+                
+                throw;
+            }
+            
+            previous.emplace_back(pos, std::move(text));
+            LogCell(pos);
+        }
+    }
+}
+
+void Sheet::FillDown(Position source, int last_row)
+{
+    FillRange(source, {source, {last_row, source.col}});
+}
+
+void Sheet::LoadDelimited(std::istream& input, char delimiter)
+{
+    // Вход читается блоками и режется на куски по границам строк; куски
+    // разбираются параллельно. Номер первой строки куска известен заранее.
+    const size_t BLOCK_SIZE = 1 << 22;
+    const size_t CHUNK_SIZE = 1 << 16;
+    
+    struct Chunk
+    {
+        std::string_view text;
+        int first_row;
+    };
+    
+    std::vector<std::vector<StagedCell>> staged;
+    std::string buffer;
+    int row = 0;
+    bool at_end = false;
+    
+    while(!at_end)
+    {
+        size_t kept = buffer.size();
+        buffer.resize(kept + BLOCK_SIZE);
+        input.read(buffer.data() + kept, BLOCK_SIZE);
+        buffer.resize(kept + static_cast<size_t>(input.gcount()));
+        at_end = !input;
+        
+        // Незаконченная последняя строка ждёт следующего блока
+        size_t end = at_end ? buffer.size() : buffer.rfind('\n') + 1;
+        std::vector<Chunk> chunks;
+        
+        for(size_t begin = 0; begin < end;)
+        {
+            // Кусок заканчивается первым переводом строки после CHUNK_SIZE байт
+            size_t newline = buffer.find('\n', std::min(begin + CHUNK_SIZE, end));
+            size_t cut = newline < end ? newline + 1 : end;
+            
+            chunks.push_back({std::string_view(buffer).substr(begin, cut - begin), row});
+            row += static_cast<int>(std::count(buffer.begin() + begin, buffer.begin() + cut, '\n'));
+            begin = cut;
+        }
+        
+        size_t first = staged.size();
+        staged.resize(first + chunks.size());
+        
+        auto stage = [&](size_t i)
+        {
+            staged[first + i] = StageRows(chunks[i].text, chunks[i].first_row, delimiter);
+        };
+        
+        if(pool_)
+        {
+            pool_->ParallelFor(chunks.size(), stage);
+        }
+        else
+        {
+            for(size_t i = 0; i < chunks.size(); ++i)
+            {
+                stage(i);
+            }
+        }
+        
+        buffer.erase(0, end);
+    }
+    
+    CommitStaged(staged);
+}
+
+void Sheet::CommitStaged(std::vector<std::vector<StagedCell>>& staged)
+{
+    // Запись без проверок и пометок: прежнее содержимое запоминается, чтобы
+    // вернуть его, если загрузка создала цикл
+    std::vector<std::pair<Position, std::string>> previous;
+    std::vector<Position> loaded;
+    std::vector<Position> formulas;
+    size_t cell_count = 0;
+    size_t formula_count = 0;
+    
+    for(const std::vector<StagedCell>& cells : staged)
+    {
+        cell_count += cells.size();
+        
+        for(const StagedCell& cell : cells)
+        {
+            formula_count += cell.formula != nullptr;
+        }
+    }
+    
+    loaded.reserve(cell_count);
+    formulas.reserve(formula_count);
+    ReserveGraph(formula_count);
+    // В пустом до загрузки графе все рёбра будут из загруженных формул
+    bool backward = dependencies_.empty() && range_dependencies_.empty();
+    
+    for(std::vector<StagedCell>& cells : staged)
+    {
+        for(StagedCell& cell : cells)
+        {
+            CellSlot old_slot = FindSlot(cell.pos);
+            
+            if(!old_slot.IsNone())
+            {
+                previous.emplace_back(cell.pos, GetCellText(cell.pos));
+            }
+            
+            std::vector<Position> refs;
+            std::vector<Range> ranges;
+            CellSlot slot;
+            
+            if(cell.formula != nullptr)
+            {
+                refs = cell.formula->GetSingleCellReferences();
+                ranges = cell.formula->GetReferencedRanges();
+                backward = backward && RefersBackward(cell.pos, refs, ranges);
+                slot = CellSlot::MakeFormula(AddFormula(std::move(cell.formula)));
+                formulas.push_back(cell.pos);
+            }
+            else if(cell.number.has_value())
+            {
+                slot = CellSlot::MakeNumber(*cell.number);
+            }
+            else if(cell.text.empty())
+            {
+                slot = CellSlot::MakeEmpty();
+            }
+            else
+            {
+                slot = CellSlot::MakeText(texts_.Intern(cell.text));
+            }
+            
+            ReleaseSlot(old_slot);
+            GetOrCreateSlot(cell.pos) = slot;
+            dirty_.erase(cell.pos);
+            StoreRefs(cell.pos, std::move(refs), std::move(ranges));
+            loaded.push_back(cell.pos);
+        }
+        
+        cells.clear();
+    }
+    
+    if(!backward && HasCycleThrough(formulas))
+    {
+        // Без загруженных ячеек граф снова без циклов, и прежние ячейки
+        // возвращаются обычной записью
+        for(Position pos : loaded)
+        {
+            ClearCell(pos);
+        }
+        
+        for(auto& [pos, text] : previous)
+        {
+            SetCell(pos, std::move(text));
+        }
+        
+        throw CircularDependencyException("Cyclic dependency detected!");
+    }
+    
+    for(Position pos : loaded)
+    {
+        Invalidate(pos);
+        UpdateColumnAggregates(pos);
+        LogCell(pos);
+    }
+    
+    Recalculate();
+}
+
+void Sheet::LoadDelimited(const std::filesystem::path& path, char delimiter)
+{
+    std::ifstream input(path, std::ios::binary);
+    
+    if(!input)
+    {
+        throw std::runtime_error("Cannot open " + path.string());
+    }
+    
+    LoadDelimited(input, delimiter);
+}
+
+void Sheet::OpenJournal(const std::filesystem::path& path)
+{
+    journal_.reset();
+    
+    auto journal = std::make_unique<Journal>(path);
+    ReplayJournal(journal->TakeRecords());
+    journal_ = std::move(journal);
+}
+
+void Sheet::SyncJournal() const
+{
+    if(journal_)
+    {
+        journal_->Sync();
+    }
+}
+
+void Sheet::CloseJournal()
+{
+    journal_.reset();
+}
+
+void Sheet::CompactJournal(const std::filesystem::path& snapshot_path)
+{
+    // Снимок подменяет прежний переименованием уже сброшенного на диск
+    // файла. При сбое остаётся либо прежний снимок с полным журналом, либо
+    // новый, и повторное применение к нему журнала ничего не меняет.
+    // Журнал очищается только после того, как на диск сброшен и каталог с
+    // переименованием, иначе после сбоя мог бы остаться прежний снимок с
+    // пустым журналом.
+    std::filesystem::path temp = snapshot_path;
+    temp += ".tmp";
+    
+    SaveSnapshot(temp);
+    SyncFile(temp);
+    std::filesystem::rename(temp, snapshot_path);
+    
+    std::filesystem::path directory = snapshot_path.parent_path();
+    SyncFile(directory.empty() ? std::filesystem::path(".") : directory);
+    
+    if(journal_)
+    {
+        journal_->Reset();
+    }
+}
+
+void Sheet::ReplayJournal(std::vector<JournalRecord> records)
+{
+    // Каждая операция задаёт ячейку целиком, так что от каждой ячейки
+    // остаётся только последняя. Очистки применяются сразу, новые тексты
+    // разбираются параллельно и записываются разом. Шаблон формулы
+    // разбирается один раз, и его копии разделяют выражение.
+    std::unordered_map<Position, size_t, PositionHasher> last;
+    
+    for(size_t i = 0; i < records.size(); ++i)
+    {
+        last[records[i].pos] = i;
+    }
+    
+    std::vector<size_t> sets;
+    
+    for(size_t i = 0; i < records.size(); ++i)
+    {
+        if(last[records[i].pos] != i)
+        {
+            continue;
+        }
+        
+        if(records[i].kind == JournalRecord::Kind::Clear)
+        {
+            ClearCell(records[i].pos);
+        }
+        else
+        {
+            sets.push_back(i);
+        }
+    }
+    
+    std::unordered_map<std::string_view, size_t> template_indices;
+    std::vector<std::string_view> template_texts;
+    std::vector<size_t> template_of(sets.size());
+    
+    for(size_t i = 0; i < sets.size(); ++i)
+    {
+        const JournalRecord& record = records[sets[i]];
+        
+        if(record.kind == JournalRecord::Kind::SetShifted)
+        {
+            auto [it, inserted] = template_indices.try_emplace(record.text, template_texts.size());
+            
+            if(inserted)
+            {
+                template_texts.push_back(record.text);
+            }
+            
+            template_of[i] = it->second;
+        }
+    }
+    
+    auto for_each_index = [this](size_t count, const std::function<void(size_t)>& body)
+    {
+        if(pool_)
+        {
+            pool_->ParallelFor(count, body);
+        }
+        else
+        {
+            for(size_t i = 0; i < count; ++i)
+            {
+                body(i);
+            }
+        }
+    };
+    
+    std::vector<std::unique_ptr<FormulaInterface>> templates(template_texts.size());
+    
+    for_each_index(templates.size(), [&](size_t i)
+    {
+        templates[i] = ParseFormula(std::string(template_texts[i]));
+    });
+    
+    std::vector<std::vector<StagedCell>> staged(1);
+    staged[0].resize(sets.size());
+    
+    for_each_index(sets.size(), [&](size_t i)
+    {
+        const JournalRecord& record = records[sets[i]];
+        
+        if(record.kind == JournalRecord::Kind::SetShifted)
+        {
+            CheckPos(record.pos);
+            staged[0][i] = {record.pos, templates[template_of[i]]->Shift(record.shift.row, record.shift.col),
+                            std::nullopt, {}};
+        }
+        else
+        {
+            staged[0][i] = StageCell(record.pos, record.text);
+        }
+    });
+    
+    CommitStaged(staged);
+}
+
+void Sheet::LogCell(Position pos) const
+{
+    if(!journal_)
+    {
+        return;
+    }
+    
+    CellSlot slot = FindSlot(pos);
+    
+    if(slot.IsNone())
+    {
+        journal_->Append(JournalRecord::Kind::Clear, pos, {});
+    }
+    else if(slot.GetTag() == CellSlot::Tag::Formula)
+    {
+        // Формула пишется шаблоном и сдвигом, как в снимке: текст копии со
+        // ссылками за краем теряет то, что стояло на месте #REF!
+        const FormulaInterface& formula = *formulas_[slot.GetHandle()].formula;
+        Position shift = formula.GetShift();
+        journal_->Append(JournalRecord::Kind::SetShifted, pos,
+                         formula.Shift(-shift.row, -shift.col)->GetExpression(), shift);
+    }
+    else
+    {
+        journal_->Append(JournalRecord::Kind::Set, pos, GetCellText(pos));
+    }
+}
+
+void Sheet::SaveSnapshot(const std::filesystem::path& path) const
+{
+    // В снимок попадают только актуальные значения
+    Recalculate();
+    
+    SnapshotWriter writer;
+    std::unordered_map<TextPool::Handle, std::uint32_t> text_indices;
+    // Шаблон уже записанной формулы по её дескриптору. Плитки и ячейки в них
+    // обходятся по строкам, так что соседи сверху и слева записаны раньше.
+    std::vector<std::uint32_t> templates(formulas_.size());
+    
+    for(size_t tile_index = 0; tile_index < tiles_.size(); ++tile_index)
+    {
+        const std::unique_ptr<Tile>& tile = tiles_[tile_index];
+        
+        if(tile == nullptr)
+        {
+            continue;
+        }
+        
+        Position origin{static_cast<int>(tile_index / TILE_COLS) * TILE_SIZE,
+                        static_cast<int>(tile_index % TILE_COLS) * TILE_SIZE};
+        
+        for(size_t i = 0; i < tile->slots.size(); ++i)
+        {
+            CellSlot slot = tile->slots[i];
+            
+            if(slot.IsNone())
+            {
+                continue;
+            }
+            
+            Position pos{origin.row + static_cast<int>(i / TILE_SIZE),
+                         origin.col + static_cast<int>(i % TILE_SIZE)};
+            
+            if(slot.GetTag() == CellSlot::Tag::Text)
+            {
+                auto [it, inserted] = text_indices.try_emplace(slot.GetHandle(), 0);
+                
+                if(inserted)
+                {
+                    it->second = writer.AddText(texts_.Get(slot.GetHandle()));
+                }
+                
+                slot = CellSlot::MakeText(it->second);
+            }
+            else if(slot.GetTag() == CellSlot::Tag::Formula)
+            {
+                const FormulaEntry& entry = formulas_[slot.GetHandle()];
+                Position shift = entry.formula->GetShift();
+                std::optional<std::uint32_t> shared;
+                
+                // Протянутая формула разделяет выражение с соседом
+                for(Position step : {Position{1, 0}, Position{0, 1}})
+                {
+                    Position neighbour{pos.row - step.row, pos.col - step.col};
+                    CellSlot other = neighbour.IsValid() ? FindSlot(neighbour) : CellSlot{};
+                    
+                    if(!shared && other.GetTag() == CellSlot::Tag::Formula
+                       && entry.formula->IsShiftOf(*formulas_[other.GetHandle()].formula,
+                                                   step.row, step.col))
+                    {
+                        shared = templates[other.GetHandle()];
+                    }
+                }
+                
+                if(!shared)
+                {
+                    shared = writer.AddTemplate(entry.formula->Shift(-shift.row, -shift.col)->GetExpression());
+                }
+                
+                templates[slot.GetHandle()] = *shared;
+                
+                SnapshotFormula record{*shared, shift.row, shift.col, 0, 0};
+                
+                if(std::holds_alternative<double>(entry.value))
+                {
+                    record.value = std::get<double>(entry.value);
+                }
+                else
+                {
+                    record.error = static_cast<std::uint32_t>(std::get<FormulaError>(entry.value).GetCategory()) + 1;
+                }
+                
+                slot = CellSlot::MakeFormula(writer.AddFormula(record));
+            }
+            
+            writer.AddCell({static_cast<std::uint32_t>(pos.row), static_cast<std::uint32_t>(pos.col),
+                            slot.GetBits()});
+        }
+    }
+    
+    writer.WriteTo(path);
+}
+
+std::unique_ptr<Sheet> Sheet::LoadSnapshot(const std::filesystem::path& path)
+{
+    MappedFile file(path);
+    SnapshotView snapshot(file.GetData());
+    auto sheet = std::make_unique<Sheet>();
+    
+    std::vector<std::unique_ptr<FormulaInterface>> templates;
+    templates.reserve(snapshot.GetTemplateCount());
+    
+    for(size_t i = 0; i < snapshot.GetTemplateCount(); ++i)
+    {
+        try
+        {
+            templates.push_back(ParseFormula(std::string(snapshot.GetTemplate(i))));
+        }
+        catch(const FormulaException&)
+        {
+            throw SnapshotException("Snapshot contains an invalid formula");
+        }
+    }
+    
+    std::vector<bool> formula_used(snapshot.GetFormulaCount());
+    std::vector<Position> formulas;
+    formulas.reserve(snapshot.GetFormulaCount());
+    sheet->ReserveGraph(snapshot.GetFormulaCount());
+    // Таблица создана пустой, и все рёбра графа - из этого снимка
+    bool backward = true;
+    
+    for(size_t i = 0; i < snapshot.GetCellCount(); ++i)
+    {
+        SnapshotCell cell = snapshot.GetCell(i);
+        Position pos{static_cast<int>(cell.row), static_cast<int>(cell.col)};
+        CellSlot slot = CellSlot::FromBits(cell.bits);
+        
+        if(cell.row >= static_cast<std::uint32_t>(Position::MAX_ROWS)
+           || cell.col >= static_cast<std::uint32_t>(Position::MAX_COLS)
+           || !sheet->FindSlot(pos).IsNone())
+        {
+            throw SnapshotException("Snapshot has an invalid cell position");
+        }
+        
+        switch(slot.GetTag())
+        {
+            case CellSlot::Tag::Number:
+            case CellSlot::Tag::Empty:
+                break;
+            case CellSlot::Tag::Text:
+                if(slot.GetHandle() >= snapshot.GetTextCount())
+                {
+                    throw SnapshotException("Snapshot has an invalid text reference");
+                }
+                
+                slot = CellSlot::MakeText(sheet->texts_.Intern(snapshot.GetText(slot.GetHandle())));
+                break;
+            case CellSlot::Tag::Formula:
+            {
+                if(slot.GetHandle() >= snapshot.GetFormulaCount() || formula_used[slot.GetHandle()])
+                {
+                    throw SnapshotException("Snapshot has an invalid formula reference");
+                }
+                
+                formula_used[slot.GetHandle()] = true;
+                SnapshotFormula record = snapshot.GetFormula(slot.GetHandle());
+                
+                if(record.template_index >= templates.size() || record.error > 3)
+                {
+                    throw SnapshotException("Snapshot has an invalid formula");
+                }
+                
+                std::unique_ptr<FormulaInterface> formula
+                    = templates[record.template_index]->Shift(record.row_shift, record.col_shift);
+                std::vector<Position> refs = formula->GetSingleCellReferences();
+                std::vector<Range> ranges = formula->GetReferencedRanges();
+                
+                std::uint32_t handle = sheet->AddFormula(std::move(formula));
+                
+                if(record.error == 0)
+                {
+                    sheet->formulas_[handle].value = record.value;
+                }
+                else
+                {
+                    sheet->formulas_[handle].value = FormulaError(
+                        static_cast<FormulaError::Category>(record.error - 1));
+                }
+                
+                backward = backward && RefersBackward(pos, refs, ranges);
+                sheet->StoreRefs(pos, std::move(refs), std::move(ranges));
+                formulas.push_back(pos);
+                slot = CellSlot::MakeFormula(handle);
+                break;
+            }
+            default:
+                throw SnapshotException("Snapshot has an invalid cell");
+        }
+        
+        sheet->GetOrCreateSlot(pos) = slot;
+    }
+    
+    if(!backward && sheet->HasCycleThrough(formulas))
+    {
+        throw SnapshotException("Snapshot contains a cyclic dependency");
+    }
+    
+    return sheet;
+}
+
+Cell* Sheet::GetCellHandle(Position pos) const
+{
+    if(FindSlot(pos).IsNone())
+    {
+        return nullptr;
+    }
+    
+    auto it = cells_.find(pos);
+    
+    if(it == cells_.end())
+    {
+        it = cells_.emplace(pos, MakePooled<Cell>(&cell_pool_, *this, pos)).first;
+    }
+    
+    return it->second.get();
+}
+
+const CellInterface* Sheet::GetCell(Position pos) const 
+{
+    CheckPos(pos);
+    
+    return GetCellHandle(pos);
+}
+
+CellInterface* Sheet::GetCell(Position pos) 
+{
+    CheckPos(pos);
+    
+    return GetCellHandle(pos);
+}
+
+void Sheet::ClearCell(Position pos) 
+{
+    CheckPos(pos);
+    
+    CellSlot slot = FindSlot(pos);
+    
+    if(slot.IsNone())
+    {
+        return;
+    }
+    
+    ReleaseSlot(slot);
+    EraseSlot(pos);
+    cells_.erase(pos);
+    dirty_.erase(pos);
+    StoreRefs(pos, {}, {});
+    Invalidate(pos);
+    UpdateColumnAggregates(pos);
+    
+    if(journal_)
+    {
+        journal_->Append(JournalRecord::Kind::Clear, pos, {});
+    }
+}
+
+Size Sheet::GetPrintableSize() const 
+{
+    return {height, width};
+}
+
+void Sheet::PrintValues(std::ostream& output) const 
+{
+    Recalculate();
+    Export(output, true);
+}
+
+std::variant<std::string, double, FormulaError> Sheet::GetCachedValue(Position pos) const
+{   
+    CellSlot slot = FindSlot(pos);
+    
+    switch(slot.GetTag())
+    {
+        case CellSlot::Tag::Number:
+            return FormatNumber(slot.GetNumber());
+        case CellSlot::Tag::Text:
+        {
+            const std::string& text = texts_.Get(slot.GetHandle());
+            
+            if(text[0] == ESCAPE_SIGN)
+            {
+                return text.substr(1);
+            }
+            
+            return text;
+        }
+        case CellSlot::Tag::Formula:
+        {
+            if(dirty_.count(pos) > 0)
+            {
+                Recalculate();
+            }
+            
+            const FormulaInterface::Value& value = formulas_[slot.GetHandle()].value;
+            
+            if(std::holds_alternative<double>(value))
+            {
+                return std::get<double>(value);
+            }
+            
+            return std::get<FormulaError>(value);
+        }
+        default:
+            return CachedValue{};
+    }
+}
+
+std::variant<double, FormulaError> Sheet::GetNumericValue(Position pos) const
+{
+    CellSlot slot = FindSlot(pos);
+    
+    switch(slot.GetTag())
+    {
+        case CellSlot::Tag::Number:
+            return slot.GetNumber();
+        case CellSlot::Tag::Text:
+        {
+            const std::optional<double>& number = texts_.GetNumber(slot.GetHandle());
+            
+            if(number.has_value())
+            {
+                return *number;
+            }
+            
+            return FormulaError(FormulaError::Category::Value);
+        }
+        case CellSlot::Tag::Formula:
+            if(dirty_.count(pos) > 0)
+            {
+                Recalculate();
+            }
+            
+            return formulas_[slot.GetHandle()].value;
+        default:
+            return 0.0;
+    }
+}
+
+bool Sheet::GetNumericColumn(Position first, size_t count, double* values) const
+{
+    if(!first.IsValid() || first.row + count > static_cast<size_t>(Position::MAX_ROWS))
+    {
+        return false;
+    }
+    
+    // Отрезками в пределах одной плитки: ячейки столбца в ней идут с шагом
+    // TILE_SIZE
+    for(size_t i = 0; i < count;)
+    {
+        Position pos{first.row + static_cast<int>(i), first.col};
+        size_t run = std::min(count - i, static_cast<size_t>(TILE_SIZE - pos.row % TILE_SIZE));
+        const Tile* tile = tiles_.empty() ? nullptr : tiles_[TileIndex(pos)].get();
+        
+        if(tile == nullptr)
+        {
+            std::fill(values + i, values + i + run, 0.0);
+            i += run;
+            continue;
+        }
+        
+        const CellSlot* slots = tile->slots.data() + IndexInTile(pos);
+        
+        for(size_t j = 0; j < run; ++j, ++i)
+        {
+            CellSlot slot = slots[j * TILE_SIZE];
+            
+            switch(slot.GetTag())
+            {
+                case CellSlot::Tag::Number:
+                    values[i] = slot.GetNumber();
+                    break;
+                case CellSlot::Tag::Text:
+                {
+                    const std::optional<double>& number = texts_.GetNumber(slot.GetHandle());
+                    
+                    if(!number.has_value())
+                    {
+                        return false;
+                    }
+                    
+                    values[i] = *number;
+                    break;
+                }
+                case CellSlot::Tag::Formula:
+                {
+                    const FormulaInterface::Value& value = formulas_[slot.GetHandle()].value;
+                    
+                    if(std::holds_alternative<FormulaError>(value)
+                       || dirty_.count({pos.row + static_cast<int>(j), pos.col}) > 0)
+                    {
+                        return false;
+                    }
+                    
+                    values[i] = std::get<double>(value);
+                    break;
+                }
+                default:
+                    values[i] = 0.0;
+                    break;
+            }
+        }
+    }
+    
+    return true;
+}
+
+std::optional<FormulaError> Sheet::AccumulateRange(Range range, RangeAccumulator& acc) const
+{
+    if(column_aggregates_.empty())
+    {
+        return AccumulateTiles(range, acc);
+    }
+    
+    for(int col = range.first.col; col <= range.last.col; ++col)
+    {
+        const ColumnAggregateTree* tree = column_aggregates_[col].get();
+        
+        if(tree == nullptr)
+        {
+            // В столбце никогда не было ячеек
+            continue;
+        }
+        
+        ColumnSummary summary = tree->Query(range.first.row, range.last.row);
+        
+        if(summary.unknown > 0)
+        {
+            // Ошибку или устаревшее значение нужно найти в самих ячейках
+            auto error = AccumulateTiles({{range.first.row, col}, {range.last.row, col}}, acc);
+            
+            if(error)
+            {
+                return error;
+            }
+            
+            continue;
+        }
+        
+        acc.sum += summary.sum;
+        acc.min = std::min(acc.min, summary.min);
+        acc.max = std::max(acc.max, summary.max);
+        acc.count += summary.count;
+    }
+    
+    return std::nullopt;
+}
+
+void Sheet::SetColumnAggregates(bool enabled)
+{
+    column_aggregates_.clear();
+    
+    if(!enabled)
+    {
+        return;
+    }
+    
+    column_aggregates_.resize(Position::MAX_COLS);
+    
+    for(size_t tile_index = 0; tile_index < tiles_.size(); ++tile_index)
+    {
+        if(tiles_[tile_index] == nullptr)
+        {
+            continue;
+        }
+        
+        Position origin{static_cast<int>(tile_index / TILE_COLS) * TILE_SIZE,
+                        static_cast<int>(tile_index % TILE_COLS) * TILE_SIZE};
+        
+        for(size_t index = 0; index < tiles_[tile_index]->slots.size(); ++index)
+        {
+            if(!tiles_[tile_index]->slots[index].IsNone())
+            {
+                UpdateColumnAggregates({origin.row + static_cast<int>(index / TILE_SIZE),
+                                        origin.col + static_cast<int>(index % TILE_SIZE)});
+            }
+        }
+    }
+}
+
+bool Sheet::HasColumnAggregates() const
+{
+    return !column_aggregates_.empty();
+}
+
+void Sheet::UpdateColumnAggregates(Position pos) const
+{
+    if(column_aggregates_.empty())
+    {
+        return;
+    }
+    
+    CellSlot slot = FindSlot(pos);
+    ColumnSummary leaf;
+    
+    switch(slot.GetTag())
+    {
+        case CellSlot::Tag::Number:
+            leaf = ColumnSummary::Number(slot.GetNumber());
+            break;
+        case CellSlot::Tag::Text:
+        {
+            const std::optional<double>& number = texts_.GetNumber(slot.GetHandle());
+            
+            if(number.has_value())
+            {
+                leaf = ColumnSummary::Number(*number);
+            }
+            
+            break;
+        }
+        case CellSlot::Tag::Formula:
+        {
+            const FormulaInterface::Value& value = formulas_[slot.GetHandle()].value;
+            
+            if(dirty_.count(pos) > 0 || std::holds_alternative<FormulaError>(value))
+            {
+                leaf = ColumnSummary::Unknown();
+            }
+            else
+            {
+                leaf = ColumnSummary::Number(std::get<double>(value));
+            }
+            
+            break;
+        }
+        default:
+            break;
     }
     
-    std::unique_ptr<Cell>& cell_ptr = data_[pos.row][pos.col];
+    std::unique_ptr<ColumnAggregateTree>& tree = column_aggregates_[pos.col];
     
-    if(cell_ptr == nullptr)
+    if(tree == nullptr)
     {
-        cell_ptr = std::unique_ptr<Cell>(new Cell{*this});
+        if(slot.IsNone())
+        {
+            return;
+        }
+        
+        tree = std::make_unique<ColumnAggregateTree>();
     }
     
-    cell_ptr->SetPos(pos);
-    
-    std::string tmp = cell_ptr->GetText();
-    
-    cell_ptr->Set(text);
+    tree->Set(pos.row, leaf);
+}
+
+std::optional<FormulaError> Sheet::AccumulateTiles(Range range, RangeAccumulator& acc) const
+{
+    if(tiles_.empty())
+    {
+        return std::nullopt;
+    }
     
-    if(HasCyclicDependency(pos))
+    for(int tile_row = range.first.row / TILE_SIZE; tile_row <= range.last.row / TILE_SIZE; ++tile_row)
     {
-        cell_ptr->Set(tmp);
-        throw CircularDependencyException("Cyclic dependency detected!");
+        for(int tile_col = range.first.col / TILE_SIZE; tile_col <= range.last.col / TILE_SIZE; ++tile_col)
+        {
+            const Tile* tile = tiles_[static_cast<size_t>(tile_row) * TILE_COLS + tile_col].get();
+            
+            if(tile == nullptr)
+            {
+                continue;
+            }
+            
+            // Часть диапазона, попадающая в плитку, в координатах плитки
+            Position origin{tile_row * TILE_SIZE, tile_col * TILE_SIZE};
+            int row_begin = std::max(range.first.row - origin.row, 0);
+            int row_end = std::min(range.last.row - origin.row, TILE_SIZE - 1);
+            int col_begin = std::max(range.first.col - origin.col, 0);
+            int col_end = std::min(range.last.col - origin.col, TILE_SIZE - 1);
+            size_t rows = row_end - row_begin + 1;
+            size_t cols = col_end - col_begin + 1;
+            
+            std::optional<FormulaError> error;
+            
+            if(cols == TILE_SIZE)
+            {
+                // Полные строки плитки лежат подряд
+                error = AccumulateSlots(*tile, origin, row_begin * TILE_SIZE, rows * TILE_SIZE, 1, acc);
+            }
+            else if(cols == 1)
+            {
+                error = AccumulateSlots(*tile, origin, row_begin * TILE_SIZE + col_begin, rows, TILE_SIZE, acc);
+            }
+            else
+            {
+                for(int row = row_begin; row <= row_end && !error; ++row)
+                {
+                    error = AccumulateSlots(*tile, origin, row * TILE_SIZE + col_begin, cols, 1, acc);
+                }
+            }
+            
+            if(error)
+            {
+                return error;
+            }
+        }
     }
+    
+    return std::nullopt;
 }
 
-const CellInterface* Sheet::GetCell(Position pos) const 
+std::optional<FormulaError> Sheet::AccumulateSlots(const Tile& tile, Position origin, size_t offset,
+                                                   size_t count, size_t stride,
+                                                   RangeAccumulator& acc) const
 {
-    CheckPos(pos);
+    const CellSlot* slots = tile.slots.data() + offset;
     
-    const std::map<int, std::map<int, std::unique_ptr<Cell>>>::const_iterator row_value = data_.find(pos.row);
+    if(!AccumulateNumberSlots(slots, count, stride, acc))
+    {
+        return std::nullopt;
+    }
     
-    if(row_value != data_.end())
+    // Числа уже учтены ядром, остаются текст и формулы
+    for(size_t i = 0; i < count; ++i)
     {
-        if((*row_value).second.find(pos.col) != (*row_value).second.end())
-        {    
-            return (*row_value).second.at(pos.col).get();
+        CellSlot slot = slots[i * stride];
+        
+        if(slot.GetTag() == CellSlot::Tag::Text)
+        {
+            const std::optional<double>& number = texts_.GetNumber(slot.GetHandle());
+            
+            if(number.has_value())
+            {
+                acc.Add(*number);
+            }
+        }
+        else if(slot.GetTag() == CellSlot::Tag::Formula)
+        {
+            size_t index = offset + i * stride;
+            Position pos{origin.row + static_cast<int>(index / TILE_SIZE),
+                         origin.col + static_cast<int>(index % TILE_SIZE)};
+            
+            if(dirty_.count(pos) > 0)
+            {
+                Recalculate();
+            }
+            
+            const FormulaInterface::Value& value = formulas_[slot.GetHandle()].value;
+            
+            if(std::holds_alternative<FormulaError>(value))
+            {
+                return std::get<FormulaError>(value);
+            }
+            
+            acc.Add(std::get<double>(value));
         }
     }
     
-    return nullptr;
+    return std::nullopt;
 }
 
-CellInterface* Sheet::GetCell(Position pos) 
+std::string Sheet::GetCellText(Position pos) const
 {
-    CheckPos(pos);
+    CellSlot slot = FindSlot(pos);
     
-    if(pos.row < height && pos.col < width)
+    switch(slot.GetTag())
     {
-        return data_[pos.row][pos.col].get();
+        case CellSlot::Tag::Number:
+            return FormatNumber(slot.GetNumber());
+        case CellSlot::Tag::Text:
+            return texts_.Get(slot.GetHandle());
+        case CellSlot::Tag::Formula:
+            return FORMULA_SIGN + formulas_[slot.GetHandle()].formula->GetExpression();
+        default:
+            return {};
     }
-    
-    return nullptr;
 }
 
-void Sheet::ClearCell(Position pos) 
+void Sheet::SetWorkerCount(size_t count)
 {
-    CheckPos(pos);
-    
-    if(pos.row >= height || pos.col >= width)
+    if(count == 0)
     {
-        return;
+        count = std::max(1u, std::thread::hardware_concurrency());
     }
-        
-    if(GetCell({pos.row, pos.col}) != nullptr)
+    
+    pool_.reset();
+    
+    if(count > 1)
     {
-        cache_.erase(pos);
-        dependencies_.erase(pos);
-        data_[pos.row][pos.col]->Clear();
+        pool_ = std::make_unique<ThreadPool>(count - 1);
     }
+}
+
+size_t Sheet::GetWorkerCount() const
+{
+    return pool_ ? pool_->GetThreadCount() + 1 : 1;
+}
+
+void Sheet::CalculateLevel(const std::vector<Position>& level) const
+{
+    const size_t MIN_PARALLEL_LEVEL = 64;
+    
+    auto entry_at = [&](Position pos) -> FormulaEntry&
+    {
+        return formulas_[FindSlot(pos).GetHandle()];
+    };
+    
+    // Ячейки упорядочиваются по столбцам и режутся на отрезки: в отрезке -
+    // одна ячейка или копии одной формулы на соседних строках
+    std::vector<Position> cells = level;
+    std::sort(cells.begin(), cells.end(), [](Position lhs, Position rhs)
+    {
+        return lhs.col != rhs.col ? lhs.col < rhs.col : lhs.row < rhs.row;
+    });
     
-    data_[pos.row].erase(pos.col);
+    std::vector<size_t> run_begins{0};
     
-    if(data_[pos.row].size() == 0)
+    for(size_t i = 1; i < cells.size(); ++i)
     {
-        data_.erase(pos.row);
+        bool continues_run = cells[i].col == cells[i - 1].col
+            && cells[i].row == cells[i - 1].row + 1
+            && i - run_begins.back() < MAX_COLUMN_RUN
+            && entry_at(cells[i]).formula->IsShiftOf(*entry_at(cells[i - 1]).formula, 1, 0);
+        
+        if(!continues_run)
+        {
+            run_begins.push_back(i);
+        }
     }
     
-    int new_height = data_.empty() ? 0 : data_.rbegin()->first + 1;
-    int new_width = 0;
+    run_begins.push_back(cells.size());
+    
+    // Каждый отрезок пишет только в записи своих ячеек
+    auto calculate = [&](size_t run)
+    {
+        size_t begin = run_begins[run];
+        size_t count = run_begins[run + 1] - begin;
+        FormulaEntry& first = entry_at(cells[begin]);
+        
+        if(count == 1)
+        {
+            first.value = first.formula->Evaluate(*this);
+            return;
+        }
+        
+        FormulaInterface::Value values[MAX_COLUMN_RUN];
+        first.formula->EvaluateColumn(*this, count, values);
+        
+        for(size_t i = 0; i < count; ++i)
+        {
+            entry_at(cells[begin + i]).value = values[i];
+        }
+    };
+    
+    size_t runs = run_begins.size() - 1;
     
-    for(const auto& row : data_)
+    if(!pool_ || level.size() < MIN_PARALLEL_LEVEL)
     {
-        int tmp_width = row.second.rbegin()->first;
+        for(size_t run = 0; run < runs; ++run)
+        {
+            calculate(run);
+        }
         
-        if(tmp_width >= new_width)
-            new_width = tmp_width + 1;
+        return;
     }
     
-    height = new_height;
-    width = new_width;
-}
-
-Size Sheet::GetPrintableSize() const 
-{
-    return {height, width};
+    pool_->ParallelFor(runs, calculate);
 }
 
-void Sheet::PrintValues(std::ostream& output) const 
+void Sheet::Recalculate() const
 {
-    int offset = width - 1;
-    for(int row = 0; row < height; ++row)
+    if(dirty_.empty())
+    {
+        return;
+    }
+    
+    // Входящая степень считается только по рёбрам внутри грязного подграфа:
+    // чистые ссылки уже имеют актуальное значение. Ребро, которое формула
+    // получает и через ячейку, и через диапазон, учитывается дважды - и так
+    // же дважды снимается ниже.
+    std::unordered_map<Position, int, PositionHasher> in_degree;
+    std::vector<Position> ready;
+    in_degree.reserve(dirty_.size());
+    
+    for(Position pos : dirty_)
+    {
+        in_degree[pos] = 0;
+    }
+    
+    for(Position pos : dirty_)
     {
-        for(int col = 0; col < width; ++col)
+        ForEachDependent(pos, [&](Position dependent)
         {
-            if(GetCell({row, col}) != nullptr)
+            auto degree = in_degree.find(dependent);
+            
+            if(degree != in_degree.end())
             {
-                auto result = GetCell({row, col})->GetValue();
-                
-                if(std::holds_alternative<double>(result))
-                {
-                    output << std::get<double>(result);
-                }
-                
-                if(std::holds_alternative<std::string>(result))
-                {
-                    output << std::get<std::string>(result);
-                }
-                
-                if(std::holds_alternative<FormulaError>(result))
-                {
-                    output << std::get<FormulaError>(result);
-                }
-            }            
-            if(col < offset)
-            {
-                output << "\t";
+                ++degree->second;
             }
+        });
+    }
+    
+    for(const auto& [pos, degree] : in_degree)
+    {
+        if(degree == 0)
+        {
+            ready.push_back(pos);
         }
-        output << "\n";
     }
-}
-
-const Cell* Sheet::GetConcreteCell(Position pos) const
-{
-    CheckPos(pos);
-        
-    const std::map<int, std::map<int, std::unique_ptr<Cell>>>::const_iterator row_value = data_.find(pos.row);
-
-    if(row_value != data_.end())
+    
+    // Обход по уровням: ячейки одного уровня не зависят друг от друга
+    while(!ready.empty())
     {
-        if((*row_value).second.find(pos.col) != (*row_value).second.end())
-        {    
-            return (*row_value).second.at(pos.col).get();
+        CalculateLevel(ready);
+        
+        std::vector<Position> next;
+        
+        for(Position pos : ready)
+        {
+            dirty_.erase(pos);
+            UpdateColumnAggregates(pos);
+            
+            ForEachDependent(pos, [&](Position dependent)
+            {
+                auto degree = in_degree.find(dependent);
+                
+                if(degree != in_degree.end() && --degree->second == 0)
+                {
+                    next.push_back(dependent);
+                }
+            });
         }
+        
+        ready = std::move(next);
     }
     
-    return nullptr;
+    assert(dirty_.empty());
 }
 
-Cell* Sheet::GetConcreteCell(Position pos)
+std::vector<Position> Sheet::GetReferencedPositions(Position pos) const
 {
-    CheckPos(pos);
+    CellSlot slot = FindSlot(pos);
     
-    if(pos.row < height && pos.col < width)
-    {    
-        return data_[pos.row][pos.col].get();
+    if(slot.GetTag() != CellSlot::Tag::Formula)
+    {
+        return {};
     }
     
-    return nullptr;
-}
-
-std::variant<std::string, double, FormulaError> Sheet::GetCachedValue(Position pos) const
-{   
-    return cache_[pos];
-}
-
-std::vector<Position> Sheet::GetReferencedPositions(Position pos) const
-{
-    return dependencies_[pos];
+    return formulas_[slot.GetHandle()].formula->GetReferencedCells();
 }
 
 Size Sheet::GetActualSize() const
@@ -206,12 +1679,12 @@ Size Sheet::GetActualSize() const
 
 void Sheet::MaybeIncreaseSizeToIncludePosition(Position pos)
 {
-    if(pos.row > height)
+    if(pos.row >= height)
     {
         height = pos.row + 1;
     }
     
-    if(pos.col > width)
+    if(pos.col >= width)
     {
         width = pos.col + 1;
     }
@@ -219,83 +1692,350 @@ void Sheet::MaybeIncreaseSizeToIncludePosition(Position pos)
 
 void Sheet::PrintTexts(std::ostream& output) const 
 {
-    int offset = width - 1;
+    Export(output, false);
+}
+
+void Sheet::Export(std::ostream& output, bool values) const
+{
+    // Вывод копится в буфере и уходит в поток крупными кусками
+    const size_t FLUSH_SIZE = 1 << 20;
+    const std::ostream* number_format = HasDefaultNumberFormat(output) ? nullptr : &output;
+    
+    if(pool_)
+    {
+        // Строки делятся на блоки, каждый печатается в свой буфер. Блоки
+        // обрабатываются волнами: волна печатается параллельно и выводится
+        // по порядку, так что в памяти не больше одной волны.
+        const int BLOCK_ROWS = 256;
+        const size_t wave_size = GetWorkerCount() * 4;
+        std::vector<std::string> blocks(wave_size);
+        
+        for(int wave_first = 0; wave_first < height; wave_first += BLOCK_ROWS * static_cast<int>(wave_size))
+        {
+            size_t count = std::min(wave_size, static_cast<size_t>((height - wave_first + BLOCK_ROWS - 1) / BLOCK_ROWS));
+            
+            pool_->ParallelFor(count, [&](size_t i)
+            {
+                int first = wave_first + static_cast<int>(i) * BLOCK_ROWS;
+                int last = std::min(height, first + BLOCK_ROWS);
+                
+                blocks[i].clear();
+                
+                for(int row = first; row < last; ++row)
+                {
+                    AppendRow(blocks[i], row, values, number_format);
+                }
+            });
+            
+            for(size_t i = 0; i < count; ++i)
+            {
+                output.write(blocks[i].data(), static_cast<std::streamsize>(blocks[i].size()));
+            }
+        }
+        
+        return;
+    }
+    
+    std::string buffer;
+    buffer.reserve(FLUSH_SIZE + FLUSH_SIZE / 4);
+    
     for(int row = 0; row < height; ++row)
     {
-        for(int col = 0; col < width; ++col)
+        AppendRow(buffer, row, values, number_format);
+        
+        if(buffer.size() >= FLUSH_SIZE)
+        {
+            output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            buffer.clear();
+        }
+    }
+    
+    output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+}
+
+void Sheet::AppendRow(std::string& out, int row, bool values, const std::ostream* number_format) const
+{
+    // Перед ячейкой столбца col в строке стоит ровно col табуляций
+    int tabs = 0;
+    int left = row_counts_.empty() ? 0 : row_counts_[row];
+    size_t tile_row = static_cast<size_t>(row / TILE_SIZE) * TILE_COLS;
+    
+    for(int tile_col = 0; left > 0 && tile_col * TILE_SIZE < width; ++tile_col)
+    {
+        const std::unique_ptr<Tile>& tile = tiles_[tile_row + tile_col];
+        
+        if(tile == nullptr)
         {
-            if(GetCell({row, col}) != nullptr)
+            continue;
+        }
+        
+        const CellSlot* slots = &tile->slots[static_cast<size_t>(row % TILE_SIZE) * TILE_SIZE];
+        
+        for(int i = 0; i < TILE_SIZE && left > 0; ++i)
+        {
+            CellSlot slot = slots[i];
+            
+            if(slot.IsNone())
             {
-                output << GetCell({row, col})->GetText();
+                continue;
             }
-            if(col < offset)
+            
+            --left;
+            int col = tile_col * TILE_SIZE + i;
+            out.append(static_cast<size_t>(col - tabs), '\t');
+            tabs = col;
+            
+            switch(slot.GetTag())
             {
-            output << "\t";
+                case CellSlot::Tag::Number:
+                    AppendNumber(out, slot.GetNumber());
+                    break;
+                case CellSlot::Tag::Text:
+                {
+                    const std::string& text = texts_.Get(slot.GetHandle());
+                    bool escaped = values && text[0] == ESCAPE_SIGN;
+                    out.append(text, escaped ? 1 : 0);
+                    break;
+                }
+                case CellSlot::Tag::Formula:
+                {
+                    const FormulaEntry& entry = formulas_[slot.GetHandle()];
+                    
+                    if(!values)
+                    {
+                        out += FORMULA_SIGN;
+                        out += entry.formula->GetExpression();
+                    }
+                    else if(std::holds_alternative<double>(entry.value))
+                    {
+                        AppendFormulaValue(out, std::get<double>(entry.value), number_format);
+                    }
+                    else
+                    {
+                        out += std::get<FormulaError>(entry.value).ToString();
+                    }
+                    break;
+                }
+                default:
+                    break;
             }
         }
-        output << "\n";
     }
-}    
+    
+    out.append(static_cast<size_t>(width - 1 - tabs), '\t');
+    out += '\n';
+}
 
-void Sheet::StoreCache(Position pos, CachedValue val) const
+void Sheet::StoreRefs(Position pos, std::vector<Position> refs, std::vector<Range> ranges)
 {
-    cache_[pos] = std::move(val);
-}
+    auto old_refs = dependencies_.find(pos);
     
-void Sheet::StoreRefs(Position pos, std::vector<Position> refs) const
-{
-    if(refs.size() > 0)
+    if(old_refs != dependencies_.end())
+    {
+        for(Position old_ref : old_refs->second)
+        {
+            auto it = dependents_.find(old_ref);
+            
+            if(it != dependents_.end())
+            {
+                it->second.erase(pos);
+                
+                if(it->second.empty())
+                {
+                    dependents_.erase(it);
+                }
+            }
+        }
+        
+        dependencies_.erase(old_refs);
+    }
+    
+    auto old_ranges = range_dependencies_.find(pos);
+    
+    if(old_ranges != range_dependencies_.end())
     {
-        Sheet::GetConcreteCell(pos)->SetRef(true);
+        for(Range old_range : old_ranges->second)
+        {
+            range_dependents_.Erase(old_range, pos);
+        }
+        
+        range_dependencies_.erase(old_ranges);
+    }
+    
+    if(!refs.empty())
+    {
+        for(Position ref : refs)
+        {
+            dependents_[ref].insert(pos);
+        }
+        
+        dependencies_[pos] = std::move(refs);
     }
     
-    dependencies_[pos] = std::move(refs);
+    if(!ranges.empty())
+    {
+        for(Range range : ranges)
+        {
+            range_dependents_.Insert(range, pos);
+        }
+        
+        range_dependencies_[pos] = std::move(ranges);
+    }
+}
+
+void Sheet::ReserveGraph(size_t count)
+{
+    dependencies_.reserve(dependencies_.size() + count);
+    dependents_.reserve(dependents_.size() + count);
+    dirty_.reserve(dirty_.size() + count);
 }
-using RecMap = std::unordered_map<Position, bool, PositionHasher>;
-bool Sheet::Cycle(Position start_pos, Position element, RecMap visited, RecMap elements) const
+
+void Sheet::Invalidate(Position pos)
 {
-    if(visited[element])
+    // Если формула уже помечена, то помечены и все зависящие от неё:
+    // чистая формула не может ссылаться на грязную ячейку.
+    std::vector<Position> stack;
+    
+    auto push = [&](Position dependent)
     {
-        elements[element] = false;
-        return false;
-    }
+        stack.push_back(dependent);
+    };
     
-    visited[element] = true;
-    elements[element] = true;
+    if(FindSlot(pos).GetTag() == CellSlot::Tag::Formula)
+    {
+        stack.push_back(pos);
+    }
+    else
+    {
+        ForEachDependent(pos, push);
+    }
     
-    for(Position neighboring_element : dependencies_[element])
+    while(!stack.empty())
     {
-        if(!visited[neighboring_element] && Cycle(start_pos, neighboring_element, visited, elements))
+        Position current = stack.back();
+        stack.pop_back();
+        
+        if(dirty_.insert(current).second)
         {
-            return true;
+            UpdateColumnAggregates(current);
+            ForEachDependent(current, push);
         }
-        else
+    }
+}
+
+bool Sheet::HasCycleThrough(const std::vector<Position>& formulas) const
+{
+    // Поиск в глубину по рёбрам "от ячейки к зависящим от неё формулам".
+    // Серая ячейка - на текущем пути, чёрная - обойдена полностью; ребро в
+    // серую ячейку замыкает цикл. Выход из ячейки - отдельная запись стека.
+    enum class Color
+    {
+        Gray,
+        Black,
+    };
+    
+    struct Visit
+    {
+        Position pos;
+        bool leaving;
+    };
+    
+    std::unordered_map<Position, Color, PositionHasher> colors;
+    colors.reserve(formulas.size());
+    std::vector<Visit> stack;
+    bool has_cycle = false;
+    
+    for(Position start : formulas)
+    {
+        stack.push_back({start, false});
+        
+        while(!stack.empty() && !has_cycle)
         {
-            if(elements[neighboring_element])
+            Visit visit = stack.back();
+            stack.pop_back();
+            
+            if(visit.leaving)
+            {
+                colors[visit.pos] = Color::Black;
+                continue;
+            }
+            
+            auto [it, inserted] = colors.try_emplace(visit.pos, Color::Gray);
+            
+            if(!inserted)
             {
-                return true;
+                // Серая здесь - та, чья запись выхода ещё в стеке, то есть
+                // предок на текущем пути
+                has_cycle = it->second == Color::Gray;
+                continue;
             }
+            
+            stack.push_back({visit.pos, true});
+            
+            ForEachDependent(visit.pos, [&](Position dependent)
+            {
+                stack.push_back({dependent, false});
+            });
+        }
+        
+        if(has_cycle)
+        {
+            return true;
         }
     }
     
     return false;
 }
 
-bool Sheet::HasCyclicDependency(Position pos) const
+bool Sheet::HasCyclicDependency(Position pos, const std::vector<Position>& refs,
+                                const std::vector<Range>& ranges) const
 {
-    RecMap visited;
-    RecMap elements;
-    std::vector<Position> refs = std::move(GetReferencedPositions(pos));
-    
-    if(refs.size() == 0)
+    // Цикл появится, если новые ссылки ведут в pos или в формулу, которая
+    // от pos зависит. Обходятся зависящие от pos формулы: их число не больше
+    // того, что пересчитывается при изменении pos, а ссылки-диапазоны
+    // раскрывать не нужно.
+    if(refs.empty() && ranges.empty())
+    {
         return false;
+    }
+    
+    auto is_referenced = [&](Position cell)
+    {
+        if(std::binary_search(refs.begin(), refs.end(), cell))
+        {
+            return true;
+        }
+        
+        return std::any_of(ranges.begin(), ranges.end(), [cell](Range range)
+        {
+            return range.Contains(cell);
+        });
+    };
     
-    for(const auto& entry : dependencies_)
+    PositionSet visited;
+    std::vector<Position> stack{pos};
+    
+    auto push = [&](Position dependent)
+    {
+        stack.push_back(dependent);
+    };
+    
+    while(!stack.empty())
     {
-        if(Cycle(pos, entry.first, visited, elements))
+        Position current = stack.back();
+        stack.pop_back();
+        
+        if(!visited.insert(current).second)
+        {
+            continue;
+        }
+        
+        if(is_referenced(current))
         {
             return true;
         }
+        
+        ForEachDependent(current, push);
     }
     
     return false;
@@ -1,23 +1,40 @@
 #pragma once
 
+#include "arena.h"
 #include "cell.h"
+#include "column_aggregates.h"
 #include "common.h"
+#include "journal.h"
+#include "range_index.h"
+#include "text_pool.h"
+#include "thread_pool.h"
 
+#include <array>
+#include <cstdint>
+#include <filesystem>
 #include <functional>
-#include <map>
+#include <istream>
+#include <memory_resource>
+#include <unordered_map>
+#include <unordered_set>
 
 class Cell;
+struct StagedCell;
 
+// Строка и столбец складываются в одно 64-битное число и перемешиваются
+// финализатором splitmix64. Простой xor строки со сдвинутым столбцом на
+// квадратных таблицах даёт одинаковые хеши тысячам ячеек, и поиск в графе
+// зависимостей вырождается в перебор.
 struct PositionHasher 
 {
     std::size_t operator()(const Position& position) const 
     {
-        std::size_t hash;
-        std::size_t h1 = std::hash<int>{}(position.col);
-        std::size_t h2 = std::hash<int>{}(position.row);
+        std::uint64_t hash = static_cast<std::uint64_t>(static_cast<std::uint32_t>(position.row)) << 32
+                             | static_cast<std::uint32_t>(position.col);
         
-        hash = h1 ^ (h2 << 1);
-        return hash;
+        hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+        hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+        return static_cast<std::size_t>(hash ^ (hash >> 31));
     }
 };
 
@@ -41,24 +58,242 @@ public:
     
     CachedValue GetCachedValue(Position pos) const override;
     std::vector<Position> GetReferencedPositions(Position pos) const override;
+    std::variant<double, FormulaError> GetNumericValue(Position pos) const override;
+    std::optional<FormulaError> AccumulateRange(Range range, RangeAccumulator& acc) const override;
+    bool GetNumericColumn(Position first, size_t count, double* values) const override;
     
-    const Cell* GetConcreteCell(Position pos) const;
-    Cell* GetConcreteCell(Position pos);
+    // Копирует ячейку source во все ячейки диапазона target, как протягивание
+    // в электронных таблицах: ссылки формулы сдвигаются вместе с ячейкой.
+    // Формула не разбирается заново - копии разделяют выражение source и
+    // хранят только свой сдвиг. Если какая-то копия создала бы цикл,
+    // бросает CircularDependencyException и возвращает таблицу к прежнему
+    // виду.
+    void FillRange(Position source, Range target);
+    // Заполняет столбец source вниз, до строки last_row (не выше source)
+    // включительно
+    void FillDown(Position source, int last_row);
     
-    void StoreCache(Position pos, CachedValue val) const;
-    void StoreRefs(Position pos, std::vector<Position> refs) const override;
+    // Загружает ячейки из текста с разделителями - обратное к PrintTexts():
+    // строки таблицы разделены переводом строки (допускается \r\n), ячейки -
+    // delimiter, и каждое непустое поле задаёт текст ячейки, как SetCell().
+    // Пустые поля ячейки не трогают, кавычки не поддерживаются.
+    //
+    // Строки разбираются кусками параллельно (см. SetWorkerCount()), ячейки
+    // и граф зависимостей записываются разом, а циклы проверяются и значения
+    // пересчитываются один раз в конце. Если в тексте есть некорректная
+    // формула или позиция либо загрузка создала бы цикл, бросает то же
+    // исключение, что и SetCell(), и таблица остаётся прежней.
+    void LoadDelimited(std::istream& input, char delimiter = '\t');
+    void LoadDelimited(const std::filesystem::path& path, char delimiter = '\t');
     
-    using RecMap = std::unordered_map<Position, bool, PositionHasher>;
-    bool Cycle(Position start_pos, Position element_pos, RecMap visited, RecMap elements) const;
-    bool HasCyclicDependency(Position pos) const;
+    // Сохраняет таблицу в двоичный снимок (формат - в snapshot.h): ячейки,
+    // тексты, формулы и их вычисленные значения. Копии одной формулы
+    // записываются одним выражением и сдвигами.
+    void SaveSnapshot(const std::filesystem::path& path) const;
+    // Открывает снимок через mmap. Числа и значения формул берутся из файла
+    // как есть, без пересчёта; каждое выражение разбирается один раз на все
+    // свои копии, а граф зависимостей строится по их ссылкам. Бросает
+    // SnapshotException, если файл повреждён или записан другой версией.
+    static std::unique_ptr<Sheet> LoadSnapshot(const std::filesystem::path& path);
+    
+    // Журнал правок для восстановления после сбоя. OpenJournal() применяет
+    // к таблице записи, уже лежащие в журнале (обычно поверх снимка из
+    // LoadSnapshot()), и дальше дописывает в него каждую успешную правку:
+    // SetCell(), ClearCell(), FillRange(), LoadDelimited(). Записи
+    // применяются разом, как в LoadDelimited(): от каждой ячейки - только
+    // последняя, циклы проверяются и значения пересчитываются один раз.
+    //
+    // Правка не ждёт диска: записи копятся в буфере, и фоновый поток
+    // сбрасывает их пачками, одним fsync на пачку. SyncJournal() дожидается,
+    // пока на диске окажутся все сделанные правки, и бросает
+    // std::runtime_error, если журнал перестал писаться. Сами правки ошибку
+    // журнала не бросают: в журнал идёт уже сделанное изменение, и
+    // исключение после него выглядело бы как отменённая правка.
+    void OpenJournal(const std::filesystem::path& path);
+    void SyncJournal() const;
+    void CloseJournal();
+    // Сохраняет таблицу в снимок snapshot_path, подменяя прежний через
+    // временный файл, и очищает журнал: его записи уже в снимке
+    void CompactJournal(const std::filesystem::path& snapshot_path);
+    
+    // Текст ячейки в том виде, в котором его вернёт CellInterface::GetText()
+    std::string GetCellText(Position pos) const;
+    
+    // Включает деревья итогов по столбцам: SUM, AVERAGE, MIN, MAX и COUNT над
+    // диапазоном тогда обходятся за O(log n) на столбец вместо обхода всех
+    // ячеек. Стоит 64-128 байт на строку столбца до его последней занятой
+    // строки и O(log n) на каждое изменение ячейки. По умолчанию выключены.
+    void SetColumnAggregates(bool enabled);
+    bool HasColumnAggregates() const;
+    
+    // Задаёт число потоков, участвующих в пересчёте, загрузке и печати
+    // (включая вызывающий). 0 - по числу аппаратных потоков, 1 - всё в
+    // вызывающем потоке. Печать в несколько потоков даёт тот же текст.
+    void SetWorkerCount(size_t count);
+    size_t GetWorkerCount() const;
+    
+    // Пересчитывает все помеченные ячейки за один проход в топологическом
+    // порядке (алгоритм Кана): каждая формула вычисляется ровно один раз и
+    // только после всех ячеек, на которые она ссылается.
+    void Recalculate() const;
+    
+    // Проверяет, достижима ли ячейка pos из ссылок refs и диапазонов ranges,
+    // которые формула в pos собирается получить. Вызывается до изменения
+    // таблицы; refs отсортированы.
+    bool HasCyclicDependency(Position pos, const std::vector<Position>& refs,
+                             const std::vector<Range>& ranges) const;
 
 private:
+    using PositionSet = std::unordered_set<Position, PositionHasher>;
+    
+    // Ячейки хранятся плитками TILE_SIZE x TILE_SIZE, которые выделяются при
+    // первой записи. Плитка находится по плоскому каталогу, покрывающему всю
+    // сетку Position::MAX_ROWS x Position::MAX_COLS, так что поиск ячейки -
+    // это два индексных обращения, а строка плитки лежит в памяти подряд.
+    // Каждая ячейка плитки - восьмибайтный CellSlot.
+    static constexpr int TILE_SIZE = 64;
+    static constexpr int TILE_ROWS = Position::MAX_ROWS / TILE_SIZE;
+    static constexpr int TILE_COLS = Position::MAX_COLS / TILE_SIZE;
+    
+    struct Tile
+    {
+        std::array<CellSlot, TILE_SIZE * TILE_SIZE> slots;
+        int count = 0;
+    };
+    
+    // Формула ячейки вместе с последним вычисленным значением
+    struct FormulaEntry
+    {
+        std::unique_ptr<FormulaInterface> formula;
+        FormulaInterface::Value value;
+    };
+    
+    static size_t TileIndex(Position pos);
+    static size_t IndexInTile(Position pos);
+    
+    CellSlot FindSlot(Position pos) const;
+    CellSlot& GetOrCreateSlot(Position pos);
+    void EraseSlot(Position pos);
+    
+    // Освобождает строку или формулу, на которую указывает слот
+    void ReleaseSlot(CellSlot slot);
+    std::uint32_t AddFormula(std::unique_ptr<FormulaInterface> formula);
+    
+    Cell* GetCellHandle(Position pos) const;
+    
+    // Проверяет формулу на циклы и записывает её в pos
+    void SetFormula(Position pos, std::unique_ptr<FormulaInterface> formula);
+    // Записывает в pos новое содержимое со ссылками refs и ranges вместо
+    // прежнего и помечает зависящие формулы
+    void StoreSlot(Position pos, CellSlot slot, std::vector<Position> refs,
+                   std::vector<Range> ranges);
+    
+    // Обходит ячейки диапазона по плиткам, без деревьев итогов
+    std::optional<FormulaError> AccumulateTiles(Range range, RangeAccumulator& acc) const;
+    
+    // Пересчитывает вклад ячейки в дерево итогов её столбца
+    void UpdateColumnAggregates(Position pos) const;
+    
+    // Добавляет к acc значения count слотов плитки, начиная с offset, с шагом
+    // stride. origin - позиция левой верхней ячейки плитки.
+    std::optional<FormulaError> AccumulateSlots(const Tile& tile, Position origin, size_t offset,
+                                                size_t count, size_t stride,
+                                                RangeAccumulator& acc) const;
+
+    // Печатает все строки таблицы: значения (values) или тексты ячеек. С
+    // пулом потоков блоки строк печатаются параллельно.
+    void Export(std::ostream& output, bool values) const;
+    // Дописывает в out строку row так, как её печатают PrintValues() и
+    // PrintTexts(). Обходит только непустые плитки строки, пропуски между
+    // ячейками заполняет табуляциями. Значения формул должны быть актуальны;
+    // number_format - поток с нестандартным форматом чисел или nullptr.
+    void AppendRow(std::string& out, int row, bool values, const std::ostream* number_format) const;
+
+    // Записывает разобранные загрузчиком ячейки разом: проверяет циклы
+    // один раз на все и пересчитывает значения. При цикле возвращает
+    // прежнее содержимое и бросает CircularDependencyException.
+    void CommitStaged(std::vector<std::vector<StagedCell>>& staged);
+    
+    // Применяет записи журнала разом
+    void ReplayJournal(std::vector<JournalRecord> records);
+    // Дописывает в журнал, если он открыт, текущее содержимое ячейки
+    void LogCell(Position pos) const;
+    
     void MaybeIncreaseSizeToIncludePosition(Position pos);
     Size GetActualSize() const;
+    
+    // Обновляет граф зависимостей: формула в pos теперь ссылается на ячейки
+    // refs и диапазоны ranges
+    void StoreRefs(Position pos, std::vector<Position> refs, std::vector<Range> ranges);
+    // Готовит граф к добавлению count формул разом, чтобы его таблицы не
+    // перестраивались по ходу загрузки
+    void ReserveGraph(size_t count);
+    
+    // Есть ли в графе зависимостей цикл через одну из формул formulas.
+    // Один обход в глубину на все формулы сразу.
+    bool HasCycleThrough(const std::vector<Position>& formulas) const;
+    
+    // Вызывает callback для каждой формулы, ссылающейся на pos напрямую или
+    // через диапазон
+    template <typename Callback>
+    void ForEachDependent(Position pos, Callback&& callback) const
+    {
+        auto it = dependents_.find(pos);
+        
+        if(it != dependents_.end())
+        {
+            for(Position dependent : it->second)
+            {
+                callback(dependent);
+            }
+        }
+        
+        range_dependents_.ForEachContaining(pos, callback);
+    }
+    
+    // Помечает формулы, транзитивно зависящие от ячейки (и её саму, если
+    // это формула), как требующие пересчёта. Сами значения пересчитываются
+    // лениво, при следующем обращении к GetCachedValue().
+    void Invalidate(Position pos);
+    
+    // Вычисляет независимые друг от друга ячейки одного уровня; при наличии
+    // пула потоков - параллельно. Копии одной формулы, идущие по столбцу
+    // подряд, вычисляются пачками через FormulaInterface::EvaluateColumn().
+    void CalculateLevel(const std::vector<Position>& level) const;
+    
+    // Самая длинная пачка - высота плитки, чтобы её ячейки читались из
+    // одной-двух плиток
+    static constexpr size_t MAX_COLUMN_RUN = TILE_SIZE;
 
-    std::map<int, std::map<int, std::unique_ptr<Cell>>> data_;
-    mutable std::unordered_map<Position, CachedValue, PositionHasher> cache_;
-    mutable std::unordered_map<Position, std::vector<Position>, PositionHasher> dependencies_;
+    std::vector<std::unique_ptr<Tile>> tiles_;
+    // Число ячеек в каждой строке и столбце - для пересчёта печатной области
+    std::vector<int> row_counts_;
+    std::vector<int> col_counts_;
+    
+    TextPool texts_;
+    mutable std::vector<FormulaEntry> formulas_;
+    std::vector<std::uint32_t> free_formulas_;
+    
+    // Объекты Cell, выданные через GetCell(), создаются по запросу и
+    // удаляются при очистке ячейки. Пул объявлен раньше, чтобы пережить их.
+    mutable std::pmr::unsynchronized_pool_resource cell_pool_;
+    mutable std::unordered_map<Position, PoolPtr<Cell>, PositionHasher> cells_;
+    
+    std::unordered_map<Position, std::vector<Position>, PositionHasher> dependencies_;
+    // Обратный индекс: для каждой ячейки - множество формул, которые на неё ссылаются
+    std::unordered_map<Position, PositionSet, PositionHasher> dependents_;
+    // Ссылки-диапазоны хранятся прямоугольниками, без раскрытия по ячейкам
+    std::unordered_map<Position, std::vector<Range>, PositionHasher> range_dependencies_;
+    RangeIndex range_dependents_;
+    // Формулы, значения которых устарели
+    mutable PositionSet dirty_;
+    
+    // По дереву на столбец, пустой вектор - деревья выключены. Меняются и при
+    // пересчёте, но только между уровнями, когда потоки не работают.
+    mutable std::vector<std::unique_ptr<ColumnAggregateTree>> column_aggregates_;
+    
+    std::unique_ptr<ThreadPool> pool_;
+    std::unique_ptr<Journal> journal_;
     
     int width = 0, height = 0;
 };
\ No newline at end of file
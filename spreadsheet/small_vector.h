@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+
+// Вектор, хранящий первые N элементов внутри себя и переходящий в кучу
+// только при переполнении. Рассчитан на простые копируемые типы вроде
+// Position: элементы копируются побайтно и не разрушаются.
+template <typename T, size_t N>
+class SmallVector
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+    SmallVector() = default;
+
+    SmallVector(const SmallVector& other)
+    {
+        Assign(other.begin(), other.end());
+    }
+
+    SmallVector& operator=(const SmallVector& other)
+    {
+        if(this != &other)
+        {
+            size_ = 0;
+            Assign(other.begin(), other.end());
+        }
+
+        return *this;
+    }
+
+    void push_back(const T& value)
+    {
+        if(size_ == capacity_)
+        {
+            Reserve(capacity_ * 2);
+        }
+
+        data()[size_++] = value;
+    }
+
+    void reserve(size_t capacity)
+    {
+        if(capacity > capacity_)
+        {
+            Reserve(capacity);
+        }
+    }
+
+    T* data()
+    {
+        return heap_ ? heap_.get() : inline_;
+    }
+
+    const T* data() const
+    {
+        return heap_ ? heap_.get() : inline_;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    T& operator[](size_t index)
+    {
+        return data()[index];
+    }
+
+    const T& operator[](size_t index) const
+    {
+        return data()[index];
+    }
+
+    T* begin()
+    {
+        return data();
+    }
+
+    T* end()
+    {
+        return data() + size_;
+    }
+
+    const T* begin() const
+    {
+        return data();
+    }
+
+    const T* end() const
+    {
+        return data() + size_;
+    }
+
+private:
+    void Assign(const T* first, const T* last)
+    {
+        reserve(last - first);
+        std::copy(first, last, data());
+        size_ = last - first;
+    }
+
+    void Reserve(size_t capacity)
+    {
+        std::unique_ptr<T[]> heap(new T[capacity]);
+        std::copy(begin(), end(), heap.get());
+        heap_ = std::move(heap);
+        capacity_ = capacity;
+    }
+
+    T inline_[N];
+    std::unique_ptr<T[]> heap_;
+    size_t size_ = 0;
+    size_t capacity_ = N;
+};
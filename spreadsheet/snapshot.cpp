@@ -0,0 +1,321 @@
+#include "snapshot.h"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SNAPSHOT_HAS_MMAP 1
+#endif
+
+namespace
+{
+const size_t ALIGNMENT = 8;
+
+size_t AlignUp(size_t size)
+{
+    return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+template <typename T>
+void AppendRecords(std::string& out, const std::vector<T>& records)
+{
+    out.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(T));
+    out.resize(AlignUp(out.size()));
+}
+
+void AppendBytes(std::string& out, std::string_view bytes)
+{
+    out.append(bytes);
+    out.resize(AlignUp(out.size()));
+}
+
+template <typename T>
+T ReadRecord(const char* data, size_t index)
+{
+    T record;
+    std::memcpy(&record, data + index * sizeof(T), sizeof(T));
+    return record;
+}
+
+// Последовательно отрезает секции от payload, проверяя, что они в нём умещаются
+class SectionReader
+{
+public:
+    explicit SectionReader(std::string_view payload)
+    :payload_(payload)
+    {}
+
+    const char* Take(std::uint64_t count, size_t record_size)
+    {
+        size_t left = payload_.size() - offset_;
+
+        if(count > left / record_size)
+        {
+            throw SnapshotException("Snapshot is truncated");
+        }
+
+        const char* section = payload_.data() + offset_;
+        offset_ += static_cast<size_t>(count) * record_size;
+        offset_ = AlignUp(offset_) < payload_.size() ? AlignUp(offset_) : payload_.size();
+        return section;
+    }
+
+    bool AtEnd() const
+    {
+        return offset_ == payload_.size();
+    }
+
+private:
+    std::string_view payload_;
+    size_t offset_ = 0;
+};
+}
+
+std::uint64_t SnapshotChecksum(std::string_view data)
+{
+    const std::uint64_t PRIME = 0x100000001b3ull;
+    std::uint64_t hash = 0xcbf29ce484222325ull;
+    size_t i = 0;
+
+    for(; i + sizeof(std::uint64_t) <= data.size(); i += sizeof(std::uint64_t))
+    {
+        std::uint64_t word;
+        std::memcpy(&word, data.data() + i, sizeof(word));
+        hash = (hash ^ word) * PRIME;
+    }
+
+    for(; i < data.size(); ++i)
+    {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * PRIME;
+    }
+
+    return hash;
+}
+
+void SnapshotWriter::AddCell(SnapshotCell cell)
+{
+    cells_.push_back(cell);
+}
+
+std::uint32_t SnapshotWriter::AddText(std::string_view text)
+{
+    texts_.append(text);
+    text_offsets_.push_back(texts_.size());
+    return static_cast<std::uint32_t>(text_offsets_.size() - 2);
+}
+
+std::uint32_t SnapshotWriter::AddTemplate(std::string_view expression)
+{
+    templates_.append(expression);
+    template_offsets_.push_back(templates_.size());
+    return static_cast<std::uint32_t>(template_offsets_.size() - 2);
+}
+
+std::uint32_t SnapshotWriter::AddFormula(SnapshotFormula formula)
+{
+    formulas_.push_back(formula);
+    return static_cast<std::uint32_t>(formulas_.size() - 1);
+}
+
+std::string SnapshotWriter::Finish() const
+{
+    std::string out(sizeof(SnapshotHeader), '\0');
+
+    AppendRecords(out, cells_);
+    AppendRecords(out, text_offsets_);
+    AppendBytes(out, texts_);
+    AppendRecords(out, template_offsets_);
+    AppendBytes(out, templates_);
+    AppendRecords(out, formulas_);
+
+    std::string_view payload = std::string_view(out).substr(sizeof(SnapshotHeader));
+
+    SnapshotHeader header;
+    std::memcpy(header.magic, SnapshotHeader::MAGIC, sizeof(header.magic));
+    header.version = SnapshotHeader::VERSION;
+    header.endian_mark = SnapshotHeader::ENDIAN_MARK;
+    header.payload_size = payload.size();
+    header.checksum = SnapshotChecksum(payload);
+    header.cell_count = cells_.size();
+    header.text_count = text_offsets_.size() - 1;
+    header.template_count = template_offsets_.size() - 1;
+    header.formula_count = formulas_.size();
+
+    std::memcpy(out.data(), &header, sizeof(header));
+    return out;
+}
+
+void SnapshotWriter::WriteTo(const std::filesystem::path& path) const
+{
+    std::string data = Finish();
+    std::ofstream output(path, std::ios::binary | std::ios::trunc);
+    output.write(data.data(), static_cast<std::streamsize>(data.size()));
+
+    if(!output)
+    {
+        throw std::runtime_error("Cannot write " + path.string());
+    }
+}
+
+MappedFile::MappedFile(const std::filesystem::path& path)
+{
+#ifdef SNAPSHOT_HAS_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+
+    if(fd >= 0)
+    {
+        struct stat info;
+
+        if(::fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            void* data = ::mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if(data != MAP_FAILED)
+            {
+                data_ = static_cast<const char*>(data);
+                size_ = static_cast<size_t>(info.st_size);
+                mapped_ = true;
+            }
+        }
+
+        ::close(fd);
+
+        if(mapped_)
+        {
+            return;
+        }
+    }
+#endif
+
+    std::ifstream input(path, std::ios::binary);
+
+    if(!input)
+    {
+        throw std::runtime_error("Cannot open " + path.string());
+    }
+
+    buffer_.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef SNAPSHOT_HAS_MMAP
+    if(mapped_)
+    {
+        ::munmap(const_cast<char*>(data_), size_);
+    }
+#endif
+}
+
+SnapshotView::SnapshotView(std::string_view data)
+{
+    if(data.size() < sizeof(SnapshotHeader))
+    {
+        throw SnapshotException("Snapshot is truncated");
+    }
+
+    std::memcpy(&header_, data.data(), sizeof(header_));
+
+    if(std::memcmp(header_.magic, SnapshotHeader::MAGIC, sizeof(header_.magic)) != 0)
+    {
+        throw SnapshotException("Not a sheet snapshot");
+    }
+
+    if(header_.version != SnapshotHeader::VERSION)
+    {
+        throw SnapshotException("Unsupported snapshot version " + std::to_string(header_.version));
+    }
+
+    if(header_.endian_mark != SnapshotHeader::ENDIAN_MARK)
+    {
+        throw SnapshotException("Snapshot was written with a different byte order");
+    }
+
+    std::string_view payload = data.substr(sizeof(SnapshotHeader));
+
+    if(header_.payload_size != payload.size())
+    {
+        throw SnapshotException("Snapshot is truncated");
+    }
+
+    if(SnapshotChecksum(payload) != header_.checksum)
+    {
+        throw SnapshotException("Snapshot checksum mismatch");
+    }
+
+    SectionReader reader(payload);
+
+    cells_ = reader.Take(header_.cell_count, sizeof(SnapshotCell));
+
+    auto take_strings = [&](std::uint64_t count)
+    {
+        StringTable table;
+        table.offsets = reader.Take(count + 1, sizeof(std::uint64_t));
+
+        std::uint64_t previous = 0;
+
+        for(size_t i = 0; i <= count; ++i)
+        {
+            std::uint64_t offset = ReadRecord<std::uint64_t>(table.offsets, i);
+
+            if(offset < previous)
+            {
+                throw SnapshotException("Snapshot string table is corrupted");
+            }
+
+            previous = offset;
+        }
+
+        table.blob = std::string_view(reader.Take(previous, 1), static_cast<size_t>(previous));
+        return table;
+    };
+
+    // Счётчики сверяются с размером до того, как к ним прибавляется единица
+    if(header_.text_count > payload.size() || header_.template_count > payload.size())
+    {
+        throw SnapshotException("Snapshot is truncated");
+    }
+
+    texts_ = take_strings(header_.text_count);
+    templates_ = take_strings(header_.template_count);
+    formulas_ = reader.Take(header_.formula_count, sizeof(SnapshotFormula));
+
+    if(!reader.AtEnd())
+    {
+        throw SnapshotException("Snapshot has trailing data");
+    }
+}
+
+SnapshotCell SnapshotView::GetCell(size_t index) const
+{
+    return ReadRecord<SnapshotCell>(cells_, index);
+}
+
+std::string_view SnapshotView::GetText(size_t index) const
+{
+    return texts_.Get(index);
+}
+
+std::string_view SnapshotView::GetTemplate(size_t index) const
+{
+    return templates_.Get(index);
+}
+
+SnapshotFormula SnapshotView::GetFormula(size_t index) const
+{
+    return ReadRecord<SnapshotFormula>(formulas_, index);
+}
+
+std::string_view SnapshotView::StringTable::Get(size_t index) const
+{
+    std::uint64_t begin = ReadRecord<std::uint64_t>(offsets, index);
+    std::uint64_t end = ReadRecord<std::uint64_t>(offsets, index + 1);
+    return blob.substr(static_cast<size_t>(begin), static_cast<size_t>(end - begin));
+}
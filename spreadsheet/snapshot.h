@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Двоичный снимок таблицы. Файл - заголовок SnapshotHeader и за ним секции,
+// каждая выровнена на 8 байт:
+//
+//   cells      cell_count записей SnapshotCell
+//   texts      text_count + 1 смещений uint64 и байты строк подряд
+//   templates  template_count + 1 смещений uint64 и тексты выражений подряд
+//   formulas   formula_count записей SnapshotFormula
+//
+// Слот ячейки записан как есть (см. CellSlot), только дескриптор текста -
+// это номер строки в секции texts, а дескриптор формулы - номер записи в
+// секции formulas. Копии одной формулы хранят общий шаблон и свой сдвиг.
+// Все числа - в порядке байтов машины, который записан в заголовке;
+// контрольная сумма считается по всему, что идёт после заголовка.
+
+// Исключение, выбрасываемое при чтении повреждённого или несовместимого
+// снимка
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+struct SnapshotHeader
+{
+    static constexpr char MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P'};
+    static constexpr std::uint32_t VERSION = 1;
+    static constexpr std::uint32_t ENDIAN_MARK = 0x01020304;
+
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t endian_mark;
+    std::uint64_t payload_size;
+    std::uint64_t checksum;
+    std::uint64_t cell_count;
+    std::uint64_t text_count;
+    std::uint64_t template_count;
+    std::uint64_t formula_count;
+};
+
+struct SnapshotCell
+{
+    std::uint32_t row;
+    std::uint32_t col;
+    std::uint64_t bits;
+};
+
+// Формула - шаблон, сдвинутый на row_shift строк и col_shift столбцов, и её
+// вычисленное значение: число value, если error == 0, иначе ошибка
+// категории error - 1
+struct SnapshotFormula
+{
+    std::uint32_t template_index;
+    std::int32_t row_shift;
+    std::int32_t col_shift;
+    std::uint32_t error;
+    double value;
+};
+
+static_assert(sizeof(SnapshotHeader) == 64);
+static_assert(sizeof(SnapshotCell) == 16);
+static_assert(sizeof(SnapshotFormula) == 24);
+
+// 64-битный FNV-1a по восьмибайтным словам, хвост - по байтам
+std::uint64_t SnapshotChecksum(std::string_view data);
+
+// Собирает снимок в памяти
+class SnapshotWriter
+{
+public:
+    void AddCell(SnapshotCell cell);
+    // Возвращают номер добавленной записи
+    std::uint32_t AddText(std::string_view text);
+    std::uint32_t AddTemplate(std::string_view expression);
+    std::uint32_t AddFormula(SnapshotFormula formula);
+
+    // Заголовок и секции, готовые к записи в файл
+    std::string Finish() const;
+    void WriteTo(const std::filesystem::path& path) const;
+
+private:
+    std::vector<SnapshotCell> cells_;
+    std::vector<std::uint64_t> text_offsets_{0};
+    std::string texts_;
+    std::vector<std::uint64_t> template_offsets_{0};
+    std::string templates_;
+    std::vector<SnapshotFormula> formulas_;
+};
+
+// Файл, отображённый в память только для чтения. Где mmap недоступен или
+// не удался, файл читается в буфер целиком.
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::filesystem::path& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::string_view GetData() const
+    {
+        return {data_, size_};
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    bool mapped_ = false;
+    std::string buffer_;
+};
+
+// Проверенный снимок поверх байтов файла: секции не копируются, записи
+// читаются прямо из них. Конструктор проверяет заголовок, контрольную сумму
+// и границы секций и бросает SnapshotException, если что-то не сходится.
+class SnapshotView
+{
+public:
+    explicit SnapshotView(std::string_view data);
+
+    size_t GetCellCount() const
+    {
+        return header_.cell_count;
+    }
+
+    size_t GetTextCount() const
+    {
+        return header_.text_count;
+    }
+
+    size_t GetTemplateCount() const
+    {
+        return header_.template_count;
+    }
+
+    size_t GetFormulaCount() const
+    {
+        return header_.formula_count;
+    }
+
+    SnapshotCell GetCell(size_t index) const;
+    std::string_view GetText(size_t index) const;
+    std::string_view GetTemplate(size_t index) const;
+    SnapshotFormula GetFormula(size_t index) const;
+
+private:
+    // Строки таблицы смещений offsets и байт blob, на которые они указывают
+    struct StringTable
+    {
+        const char* offsets = nullptr;
+        std::string_view blob;
+
+        std::string_view Get(size_t index) const;
+    };
+
+    SnapshotHeader header_;
+    const char* cells_ = nullptr;
+    StringTable texts_;
+    StringTable templates_;
+    const char* formulas_ = nullptr;
+};
@@ -78,6 +78,32 @@ Position Position::FromString(std::string_view str)
     return {row - 1, col - 1};
 }
 
+bool Range::operator==(Range rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool Range::IsValid() const {
+    return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return pos.row >= first.row && pos.row <= last.row
+        && pos.col >= first.col && pos.col <= last.col;
+}
+
+std::string Range::ToString() const {
+    if (!IsValid()) {
+        return "";
+    }
+
+    return first.ToString() + ':' + last.ToString();
+}
+
+Range Range::FromCorners(Position a, Position b) {
+    return {{std::min(a.row, b.row), std::min(a.col, b.col)},
+            {std::max(a.row, b.row), std::max(a.col, b.col)}};
+}
+
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
 }
\ No newline at end of file
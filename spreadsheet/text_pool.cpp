@@ -0,0 +1,87 @@
+#include "text_pool.h"
+
+#include "common.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+
+std::optional<double> ParseNumericText(std::string_view text)
+{
+    bool numeric_chars = std::all_of(text.begin(), text.end(), [](char c)
+    {
+        return std::isdigit(static_cast<unsigned char>(c)) || c == '.' || c == '-';
+    });
+    
+    if(text.empty() || !numeric_chars)
+    {
+        return std::nullopt;
+    }
+    
+    double number = 0;
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), number);
+    
+    if(error != std::errc() || end != text.data() + text.size())
+    {
+        return std::nullopt;
+    }
+    
+    return number;
+}
+
+TextPool::Handle TextPool::Intern(std::string_view text)
+{
+    auto it = index_.find(text);
+    
+    if(it != index_.end())
+    {
+        ++entries_[it->second].refs;
+        return it->second;
+    }
+    
+    Handle handle;
+    
+    if(!free_.empty())
+    {
+        handle = free_.back();
+        free_.pop_back();
+    }
+    else
+    {
+        handle = static_cast<Handle>(entries_.size());
+        entries_.emplace_back();
+    }
+    
+    Entry& entry = entries_[handle];
+    entry.text.assign(text);
+    entry.refs = 1;
+    
+    std::string_view value = text;
+    
+    if(!value.empty() && value[0] == ESCAPE_SIGN)
+    {
+        value.remove_prefix(1);
+    }
+    
+    // Пустой текст формулы считают нулём
+    entry.number = value.empty() ? std::optional<double>(0.0) : ParseNumericText(value);
+    index_.emplace(entry.text, handle);
+    
+    return handle;
+}
+
+void TextPool::Release(Handle handle)
+{
+    Entry& entry = entries_[handle];
+    
+    if(--entry.refs > 0)
+    {
+        return;
+    }
+    
+    index_.erase(entry.text);
+    entry.text.clear();
+    entry.text.shrink_to_fit();
+    entry.number.reset();
+    free_.push_back(handle);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Разбирает текст, который формулы трактуют как число: только цифры, точка
+// и минус, причём строка должна разбираться целиком
+std::optional<double> ParseNumericText(std::string_view text);
+
+// Хранилище интернированных строк: одинаковые тексты ячеек хранятся один
+// раз, а ячейка держит только 32-битный дескриптор. Строки удаляются, когда
+// на них не остаётся ссылок. Числовое значение строки определяется один раз,
+// при её добавлении.
+class TextPool
+{
+public:
+    using Handle = std::uint32_t;
+
+    // Возвращает дескриптор строки, увеличивая число ссылок на неё
+    Handle Intern(std::string_view text);
+    void Release(Handle handle);
+
+    const std::string& Get(Handle handle) const
+    {
+        return entries_[handle].text;
+    }
+    
+    // Число, которое видит формула при чтении ячейки с этим текстом
+    // (без ведущего апострофа); nullopt, если текст не числовой
+    const std::optional<double>& GetNumber(Handle handle) const
+    {
+        return entries_[handle].number;
+    }
+
+private:
+    struct Entry
+    {
+        std::string text;
+        std::optional<double> number;
+        std::uint32_t refs = 0;
+    };
+
+    // deque не перемещает элементы, поэтому ключи индекса остаются валидными
+    std::deque<Entry> entries_;
+    std::vector<Handle> free_;
+    std::unordered_map<std::string_view, Handle> index_;
+};
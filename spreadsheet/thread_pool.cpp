@@ -0,0 +1,167 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(size_t thread_count)
+{
+    queues_.reserve(thread_count);
+    
+    for(size_t i = 0; i < thread_count; ++i)
+    {
+        queues_.push_back(std::make_unique<WorkerQueue>());
+    }
+    
+    workers_.reserve(thread_count);
+    
+    for(size_t i = 0; i < thread_count; ++i)
+    {
+        workers_.emplace_back([this, i]
+        {
+            WorkerLoop(i);
+        });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    
+    wake_.notify_all();
+    
+    for(std::thread& worker : workers_)
+    {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::GetThreadCount() const
+{
+    return workers_.size();
+}
+
+void ThreadPool::Push(size_t queue_index, Job job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++pending_;
+    }
+    
+    {
+        WorkerQueue& queue = *queues_[queue_index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.jobs.push_back(std::move(job));
+    }
+    
+    wake_.notify_one();
+}
+
+bool ThreadPool::TryPop(size_t queue_index, Job& job)
+{
+    WorkerQueue& queue = *queues_[queue_index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    
+    if(queue.jobs.empty())
+    {
+        return false;
+    }
+    
+    job = std::move(queue.jobs.front());
+    queue.jobs.pop_front();
+    --pending_;
+    return true;
+}
+
+bool ThreadPool::TrySteal(size_t thief_index, Job& job)
+{
+    size_t count = queues_.size();
+    
+    for(size_t offset = 1; offset <= count; ++offset)
+    {
+        WorkerQueue& queue = *queues_[(thief_index + offset) % count];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        
+        if(queue.jobs.empty())
+        {
+            continue;
+        }
+        
+        job = std::move(queue.jobs.back());
+        queue.jobs.pop_back();
+        --pending_;
+        return true;
+    }
+    
+    return false;
+}
+
+void ThreadPool::WorkerLoop(size_t index)
+{
+    while(true)
+    {
+        Job job;
+        
+        if(TryPop(index, job) || TrySteal(index, job))
+        {
+            job();
+            continue;
+        }
+        
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this]
+        {
+            return stop_ || pending_ > 0;
+        });
+        
+        if(stop_ && pending_ == 0)
+        {
+            return;
+        }
+    }
+}
+
+void ThreadPool::RunBatch(Batch& batch, std::vector<Job> jobs)
+{
+    batch.remaining = jobs.size();
+    
+    for(size_t i = 0; i < jobs.size(); ++i)
+    {
+        Job job = [&batch, inner = std::move(jobs[i])]
+        {
+            inner();
+            
+            // Счётчик уменьшается под мьютексом: иначе ожидающий поток мог бы
+            // уничтожить batch раньше, чем мы к нему обратимся
+            std::lock_guard<std::mutex> lock(batch.mutex);
+            
+            if(--batch.remaining == 0)
+            {
+                batch.done.notify_all();
+            }
+        };
+        
+        if(queues_.empty())
+        {
+            job();
+        }
+        else
+        {
+            Push(i % queues_.size(), std::move(job));
+        }
+    }
+    
+    // Пока есть работа - помогаем её выполнять
+    Job job;
+    
+    while(batch.remaining > 0 && !queues_.empty() && TrySteal(queues_.size() - 1, job))
+    {
+        job();
+        job = nullptr;
+    }
+    
+    std::unique_lock<std::mutex> lock(batch.mutex);
+    batch.done.wait(lock, [&batch]
+    {
+        return batch.remaining == 0;
+    });
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с перехватом работы (work stealing).
+// У каждого рабочего потока своя очередь задач: поток берёт задачи с начала
+// своей очереди, а освободившись - забирает их с конца чужих очередей.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(size_t thread_count);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t GetThreadCount() const;
+
+    // Выполняет task(i) для каждого i из [0, count) и дожидается завершения.
+    // Вызывающий поток тоже участвует в работе. Первое исключение, выброшенное
+    // задачей, пробрасывается наружу после завершения остальных.
+    template <typename Task>
+    void ParallelFor(size_t count, Task task);
+
+private:
+    using Job = std::function<void()>;
+
+    struct WorkerQueue
+    {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    struct Batch
+    {
+        std::atomic<size_t> remaining{0};
+        std::mutex mutex;
+        std::condition_variable done;
+        std::exception_ptr error;
+    };
+
+    void Push(size_t queue_index, Job job);
+    bool TryPop(size_t queue_index, Job& job);
+    bool TrySteal(size_t thief_index, Job& job);
+    void WorkerLoop(size_t index);
+    void RunBatch(Batch& batch, std::vector<Job> jobs);
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::atomic<size_t> pending_{0};
+    bool stop_ = false;
+};
+
+template <typename Task>
+void ThreadPool::ParallelFor(size_t count, Task task)
+{
+    if(count == 0)
+    {
+        return;
+    }
+
+    // Несколько кусков на поток, чтобы было что перехватывать
+    size_t chunk_count = std::min(count, (workers_.size() + 1) * 4);
+    size_t chunk_size = (count + chunk_count - 1) / chunk_count;
+
+    Batch batch;
+    std::vector<Job> jobs;
+    jobs.reserve(chunk_count);
+
+    for(size_t begin = 0; begin < count; begin += chunk_size)
+    {
+        size_t end = std::min(count, begin + chunk_size);
+
+        jobs.push_back([&batch, &task, begin, end]
+        {
+            try
+            {
+                for(size_t i = begin; i < end; ++i)
+                {
+                    task(i);
+                }
+            }
+            catch(...)
+            {
+                std::lock_guard<std::mutex> lock(batch.mutex);
+
+                if(!batch.error)
+                {
+                    batch.error = std::current_exception();
+                }
+            }
+        });
+    }
+
+    RunBatch(batch, std::move(jobs));
+
+    if(batch.error)
+    {
+        std::rethrow_exception(batch.error);
+    }
+}